@@ -0,0 +1,449 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "capture.h"
+
+#define TRY(predicate) if(!(predicate)) goto fail
+
+#define HEADER_SIZE 16
+#define RECORD_SIZE 24
+#define TILE_HEADER_SIZE 8
+#define TILE_PIXELS (FB_TILE_SIZE * FB_TILE_SIZE)
+// Longest encoding of n pixels: all literals, with a packet byte for every 128
+#define MAX_ENCODED(n) ((n) * sizeof(Pixel) + ((n) + 127) / 128)
+
+// The changed tiles of one swap, copied out of lastFrame
+typedef struct captureRecord {
+	uint64_t time, seq;
+	uint32_t flags;
+	int numTiles;
+	uint32_t *tiles; // Indices of the tiles, row-major
+	Pixel *pixels; // Each tile's pixels in row order, one tile after another
+	size_t capacity; // Pixels that fit in pixels
+} CaptureRecord;
+
+struct frameCapture {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; // Signalled when a record is queued or the thread should stop
+	pthread_cond_t space; // Signalled when a record has been written
+	int running;
+	FILE *file;
+	int error; // errno of the first failed write, only used by the thread until it stops
+	int width, height;
+	int tilesX, tilesY;
+	uint8_t *pending; // One flag per tile that changed since the last record
+	uint64_t seq; // Swaps so far
+	uint64_t lastTime; // When the last swap happened
+	int numRecords;
+	CaptureRecord *records; // A ring of numRecords with count queued from head
+	int head, count;
+	uint8_t *encoded; // Room for the encoding of a record with every tile
+	CaptureStats stats;
+};
+
+static void put16(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static uint32_t get16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return get16(p) | (get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t *p) {
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+// Pixel rectangle [*x0, *x1) by [*y0, *y1) covered by tile t
+static void tileRect(int width, int height, int tilesX, uint32_t t, int *x0, int *x1, int *y0, int *y1) {
+	*x0 = (t % tilesX) * FB_TILE_SIZE;
+	*y0 = (t / tilesX) * FB_TILE_SIZE;
+	*x1 = (*x0 + FB_TILE_SIZE < width) ? *x0 + FB_TILE_SIZE : width;
+	*y1 = (*y0 + FB_TILE_SIZE < height) ? *y0 + FB_TILE_SIZE : height;
+}
+
+static int samePixel(const Pixel *a, const Pixel *b) {
+	return !memcmp(a, b, sizeof(Pixel));
+}
+
+// Run-length encode n pixels into out, returns the number of bytes used
+static size_t encodeRuns(uint8_t *out, const Pixel *p, size_t n) {
+	uint8_t *o = out;
+	size_t i = 0;
+	while(i < n) {
+		size_t run = 1;
+		while((i + run < n) && (run < 128) && samePixel(p + i + run, p + i)) run++;
+		if(run > 1) {
+			*o++ = 127 + run;
+			memcpy(o, p + i, sizeof(Pixel));
+			o += sizeof(Pixel);
+			i += run;
+			continue;
+		}
+		// Literals up to the start of the next run
+		size_t literal = 1;
+		while((i + literal < n) && (literal < 128) && !((i + literal + 1 < n) && samePixel(p + i + literal, p + i + literal + 1))) literal++;
+		*o++ = literal - 1;
+		memcpy(o, p + i, literal * sizeof(Pixel));
+		o += literal * sizeof(Pixel);
+		i += literal;
+	}
+	return o - out;
+}
+
+// Decode length bytes of runs into exactly n pixels, returns non-zero if they don't match
+static int decodeRuns(Pixel *out, size_t n, const uint8_t *in, size_t length) {
+	const uint8_t *end = in + length;
+	size_t i = 0;
+	while(in < end) {
+		uint8_t packet = *in++;
+		if(packet < 128) {
+			size_t literal = packet + 1;
+			if((i + literal > n) || ((size_t)(end - in) < literal * sizeof(Pixel))) return 1;
+			memcpy(out + i, in, literal * sizeof(Pixel));
+			in += literal * sizeof(Pixel);
+			i += literal;
+		} else {
+			size_t run = packet - 127;
+			if((i + run > n) || ((size_t)(end - in) < sizeof(Pixel))) return 1;
+			for(size_t k = 0; k < run; k++) memcpy(out + i + k, in, sizeof(Pixel));
+			in += sizeof(Pixel);
+			i += run;
+		}
+	}
+	return i != n;
+}
+
+// Encode a record into c->encoded and write it, returns the number of bytes written
+static size_t writeRecord(FrameCapture *c, const CaptureRecord *r) {
+	uint8_t *o = c->encoded;
+	const Pixel *p = r->pixels;
+	put64(o, r->time);
+	put64(o + 8, r->seq);
+	put32(o + 16, r->numTiles);
+	put32(o + 20, r->flags);
+	o += RECORD_SIZE;
+	for(int i = 0; i < r->numTiles; i++) {
+		int x0, x1, y0, y1;
+		tileRect(c->width, c->height, c->tilesX, r->tiles[i], &x0, &x1, &y0, &y1);
+		size_t n = (size_t)(x1 - x0) * (y1 - y0);
+		size_t length = encodeRuns(o + TILE_HEADER_SIZE, p, n);
+		put16(o, r->tiles[i] % c->tilesX);
+		put16(o + 2, r->tiles[i] / c->tilesX);
+		put32(o + 4, length);
+		o += TILE_HEADER_SIZE + length;
+		p += n;
+	}
+	size_t size = o - c->encoded;
+	if(fwrite(c->encoded, 1, size, c->file) != size) {
+		c->error = errno ? errno : EIO;
+		return 0;
+	}
+	return size;
+}
+
+static void *writeLoop(FrameCapture *c) {
+	pthread_mutex_lock(&c->lock);
+	for(;;) {
+		while(!c->count && c->running) pthread_cond_wait(&c->wake, &c->lock);
+		if(!c->count) break; // Stopped with everything written
+		CaptureRecord *r = &c->records[c->head];
+		pthread_mutex_unlock(&c->lock);
+
+		// Once a write fails the rest of the file is useless
+		size_t written = c->error ? 0 : writeRecord(c, r);
+
+		pthread_mutex_lock(&c->lock);
+		c->head = (c->head + 1) % c->numRecords;
+		c->count--;
+		c->stats.bytes += written;
+		pthread_cond_signal(&c->space);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+// Queue a record of the pending tiles of lastFrame for the last swap. If the queue is full either wait for room or
+// (rather than stall swap) leave the changes pending for a later record.
+static void queueRecord(FrameCapture *c, FrameBufferDevice *fbd, int wait) {
+	int numTiles = c->tilesX * c->tilesY;
+	pthread_mutex_lock(&c->lock);
+	while(wait && (c->count == c->numRecords)) pthread_cond_wait(&c->space, &c->lock);
+	int full = c->count == c->numRecords;
+	if(full) c->stats.merged++;
+	CaptureRecord *r = &c->records[(c->head + c->count) % c->numRecords];
+	pthread_mutex_unlock(&c->lock);
+	if(full) return;
+
+	size_t pixels = 0;
+	r->numTiles = 0;
+	for(int t = 0; t < numTiles; t++) {
+		if(!c->pending[t]) continue;
+		int x0, x1, y0, y1;
+		tileRect(c->width, c->height, c->tilesX, t, &x0, &x1, &y0, &y1);
+		r->tiles[r->numTiles++] = t;
+		pixels += (size_t)(x1 - x0) * (y1 - y0);
+	}
+	if(pixels > r->capacity) {
+		Pixel *grown = realloc(r->pixels, pixels * sizeof(Pixel));
+		if(!grown) {
+			pthread_mutex_lock(&c->lock);
+			c->stats.merged++;
+			pthread_mutex_unlock(&c->lock);
+			return;
+		}
+		r->pixels = grown;
+		r->capacity = pixels;
+	}
+	Pixel *p = r->pixels;
+	for(int i = 0; i < r->numTiles; i++) {
+		int x0, x1, y0, y1;
+		tileRect(c->width, c->height, c->tilesX, r->tiles[i], &x0, &x1, &y0, &y1);
+		for(int line = y0; line < y1; line++, p += x1 - x0) {
+			memcpy(p, fbd->lastFrame + (size_t)line * fbd->pitch + x0, (x1 - x0) * sizeof(Pixel));
+		}
+		c->pending[r->tiles[i]] = 0;
+	}
+	r->time = c->lastTime;
+	r->seq = c->seq - 1;
+	r->flags = (r->numTiles == numTiles) ? FB_CAPTURE_KEY : 0;
+
+	pthread_mutex_lock(&c->lock);
+	c->count++;
+	c->stats.frames++;
+	c->stats.tiles += r->numTiles;
+	pthread_cond_signal(&c->wake);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void captureSwap(FrameBufferDevice *fbd, uint8_t mask) {
+	FrameCapture *c = fbd->capture;
+	int numTiles = c->tilesX * c->tilesY;
+	if(mask) {
+		for(int t = 0; t < numTiles; t++) c->pending[t] |= (fbd->damaged[t] & mask) != 0;
+	} else {
+		// Without damage the only way to tell what changed is to compare with the frame shown before
+		for(int t = 0; t < numTiles; t++) {
+			int x0, x1, y0, y1;
+			if(c->pending[t]) continue;
+			tileRect(c->width, c->height, c->tilesX, t, &x0, &x1, &y0, &y1);
+			for(int line = y0; line < y1; line++) {
+				size_t off = (size_t)line * fbd->pitch + x0;
+				if(memcmp(fbd->lastFrame + off, fbd->nextFrame + off, (x1 - x0) * sizeof(Pixel))) {
+					c->pending[t] = 1;
+					break;
+				}
+			}
+		}
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	c->lastTime = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	c->seq++;
+	queueRecord(c, fbd, 0);
+}
+
+static void freeCapture(FrameCapture *c) {
+	if(c->records) {
+		for(int i = 0; i < c->numRecords; i++) {
+			free(c->records[i].tiles);
+			free(c->records[i].pixels);
+		}
+	}
+	free(c->records);
+	free(c->pending);
+	free(c->encoded);
+	free(c);
+}
+
+int startCaptureFBDev(FrameBufferDevice *fbd, const char *path, int queueFrames) {
+	assert(fbd);
+	if(fbd->capture) return 1;
+	FrameCapture *c = NULL;
+	uint8_t header[HEADER_SIZE];
+	errno = EINVAL;
+	TRY(!fbd->async);
+	if(queueFrames < 1) queueFrames = 1;
+	TRY(c = calloc(1, sizeof(FrameCapture)));
+	c->running = 1;
+	c->width = fbd->xres;
+	c->height = fbd->yres;
+	c->tilesX = fbd->tilesX;
+	c->tilesY = fbd->tilesY;
+	c->numRecords = queueFrames;
+	size_t numTiles = (size_t)c->tilesX * c->tilesY;
+	TRY(c->records = calloc(queueFrames, sizeof(CaptureRecord)));
+	for(int i = 0; i < queueFrames; i++) TRY(c->records[i].tiles = malloc(numTiles * sizeof(uint32_t)));
+	// The first record has every tile
+	TRY(c->pending = malloc(numTiles));
+	memset(c->pending, 1, numTiles);
+	TRY(c->encoded = malloc(RECORD_SIZE + numTiles * (TILE_HEADER_SIZE + MAX_ENCODED(TILE_PIXELS))));
+	TRY(c->file = fopen(path, "wb"));
+	put32(header, FB_CAPTURE_MAGIC);
+	put16(header + 4, FB_CAPTURE_VERSION);
+	put16(header + 6, FB_TILE_SIZE);
+	put32(header + 8, c->width);
+	put32(header + 12, c->height);
+	TRY(fwrite(header, 1, HEADER_SIZE, c->file) == HEADER_SIZE);
+	c->stats.bytes = HEADER_SIZE;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->wake, NULL);
+	pthread_cond_init(&c->space, NULL);
+	if(pthread_create(&c->thread, NULL, (void *(*)(void *)) writeLoop, c) != 0) {
+		pthread_mutex_destroy(&c->lock);
+		pthread_cond_destroy(&c->wake);
+		pthread_cond_destroy(&c->space);
+		goto fail;
+	}
+	fbd->capture = c;
+	return 0;
+fail:
+	perror("startCaptureFBDev");
+	if(c) {
+		if(c->file) fclose(c->file);
+		freeCapture(c);
+	}
+	return -1;
+}
+
+int stopCaptureFBDev(FrameBufferDevice *fbd) {
+	assert(fbd);
+	FrameCapture *c = fbd->capture;
+	if(!c) return 0;
+	// Changes left pending by a full queue are on screen: record them before finishing
+	size_t numTiles = (size_t)c->tilesX * c->tilesY;
+	if(c->seq && memchr(c->pending, 1, numTiles)) queueRecord(c, fbd, 1);
+	pthread_mutex_lock(&c->lock);
+	c->running = 0;
+	pthread_cond_signal(&c->wake);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+	fbd->capture = NULL;
+	int error = c->error;
+	if((fclose(c->file) != 0) && !error) error = errno;
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->wake);
+	pthread_cond_destroy(&c->space);
+	freeCapture(c);
+	if(error) {
+		errno = error;
+		perror("stopCaptureFBDev");
+		return -1;
+	}
+	return 0;
+}
+
+int getCaptureStatsFBDev(FrameBufferDevice *fbd, CaptureStats *stats) {
+	assert(fbd && stats);
+	FrameCapture *c = fbd->capture;
+	if(!c) return 1;
+	pthread_mutex_lock(&c->lock);
+	*stats = c->stats;
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+CaptureReader *openCapture(const char *path) {
+	CaptureReader *r = NULL;
+	uint8_t header[HEADER_SIZE];
+	TRY(r = calloc(1, sizeof(CaptureReader)));
+	TRY(r->file = fopen(path, "rb"));
+	errno = EINVAL;
+	TRY(fread(header, 1, HEADER_SIZE, r->file) == HEADER_SIZE);
+	TRY((get32(header) == FB_CAPTURE_MAGIC) && (get16(header + 4) == FB_CAPTURE_VERSION));
+	r->tileSize = get16(header + 6);
+	r->width = get32(header + 8);
+	r->height = get32(header + 12);
+	TRY((r->tileSize > 0) && (r->width > 0) && (r->height > 0) && (r->width <= 65536) && (r->height <= 65536));
+	r->tilesX = (r->width + r->tileSize - 1) / r->tileSize;
+	r->tilesY = (r->height + r->tileSize - 1) / r->tileSize;
+	r->bufferSize = MAX_ENCODED((size_t)r->tileSize * r->tileSize);
+	TRY(r->frame = calloc((size_t)r->width * r->height, sizeof(Pixel)));
+	TRY(r->buffer = malloc(r->bufferSize));
+	TRY(r->tile = malloc((size_t)r->tileSize * r->tileSize * sizeof(Pixel)));
+	return r;
+fail:
+	perror("openCapture");
+	if(r) closeCapture(r);
+	return NULL;
+}
+
+void closeCapture(CaptureReader *r) {
+	if(r->file) fclose(r->file);
+	free(r->frame);
+	free(r->buffer);
+	free(r->tile);
+	free(r);
+}
+
+int readCapture(CaptureReader *r, FrameBufferDevice *fbd) {
+	uint8_t record[RECORD_SIZE];
+	size_t got = fread(record, 1, RECORD_SIZE, r->file);
+	if(!got && feof(r->file)) return 0;
+	errno = EINVAL;
+	TRY(got == RECORD_SIZE);
+	TRY(!fbd || ((fbd->xres == r->width) && (fbd->yres == r->height)));
+	uint32_t numTiles = get32(record + 16);
+	TRY(numTiles <= (uint32_t)(r->tilesX * r->tilesY));
+	r->time = get64(record);
+	r->seq = get64(record + 8);
+	r->flags = get32(record + 20);
+	for(uint32_t i = 0; i < numTiles; i++) {
+		uint8_t tile[TILE_HEADER_SIZE];
+		errno = EINVAL;
+		TRY(fread(tile, 1, TILE_HEADER_SIZE, r->file) == TILE_HEADER_SIZE);
+		uint32_t tx = get16(tile), ty = get16(tile + 2), length = get32(tile + 4);
+		TRY((tx < (uint32_t)r->tilesX) && (ty < (uint32_t)r->tilesY) && (length <= r->bufferSize));
+		TRY(fread(r->buffer, 1, length, r->file) == length);
+		int x0 = tx * r->tileSize, y0 = ty * r->tileSize;
+		int w = (x0 + r->tileSize < r->width) ? r->tileSize : r->width - x0;
+		int h = (y0 + r->tileSize < r->height) ? r->tileSize : r->height - y0;
+		TRY(!decodeRuns(r->tile, (size_t)w * h, r->buffer, length));
+		for(int line = 0; line < h; line++) {
+			memcpy(r->frame + (size_t)(y0 + line) * r->width + x0, r->tile + line * w, w * sizeof(Pixel));
+			if(fbd) memcpy(fbd->nextFrame + (size_t)(y0 + line) * fbd->pitch + x0, r->tile + line * w, w * sizeof(Pixel));
+		}
+		if(fbd) fbd->damage(fbd, x0, y0, w, h);
+	}
+	return 1;
+fail:
+	perror("readCapture");
+	return -1;
+}
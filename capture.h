@@ -0,0 +1,80 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fb.h"
+
+// Capture files start with a header:
+//	uint32_t magic (FB_CAPTURE_MAGIC), uint16_t version, uint16_t tileSize, uint32_t width, uint32_t height
+// followed by one record per captured swap:
+//	uint64_t time (CLOCK_MONOTONIC nanoseconds), uint64_t seq (swaps since capturing started), uint32_t numTiles, uint32_t flags
+// and numTiles tiles that changed, each:
+//	uint16_t tx, uint16_t ty, uint32_t length, then length bytes of the tile's pixels (r, g, b, a) in row order, run-length encoded as
+//	packets of a byte n: below 128 n + 1 literal pixels follow, otherwise one pixel follows that repeats n - 127 times.
+// Tiles on the right and bottom edges are cut short by the frame. Numbers are little endian.
+#define FB_CAPTURE_MAGIC 0x50414346
+#define FB_CAPTURE_VERSION 1
+#define FB_CAPTURE_KEY 0x01 // Flag of records holding every tile
+
+typedef struct captureStats {
+	uint64_t frames; // Records queued
+	uint64_t merged; // Swaps not recorded because the queue was full: their changes went into the next record
+	uint64_t tiles; // Tiles queued
+	uint64_t bytes; // Written to the file so far
+} CaptureStats;
+
+// Record what each swap puts on the screen to the file at path. Only the tiles that changed are copied during swap:
+// a thread owned by fbd encodes and writes them, with up to queueFrames (at least 1) records waiting for it.
+// Start and stop capturing while not presenting asynchronously, and don't scale or rotate while capturing.
+// Returns 0 on success, 1 if already started, -1 on failure.
+int startCaptureFBDev(FrameBufferDevice *fbd, const char *path, int queueFrames);
+// Record changes held back by a full queue, write everything queued and close the file. Returns 0 on success, -1 if anything couldn't be written. Called by close.
+int stopCaptureFBDev(FrameBufferDevice *fbd);
+// Returns non-zero if not capturing
+int getCaptureStatsFBDev(FrameBufferDevice *fbd, CaptureStats *stats);
+// Called by swap once lastFrame holds the new frame: tiles of fbd->damaged with any bits of mask set are the ones that changed,
+// or if mask is 0 lastFrame is compared with nextFrame, the frame shown before it.
+void captureSwap(FrameBufferDevice *fbd, uint8_t mask);
+
+// Plays capture files back
+typedef struct captureReader {
+	int width, height;
+	Pixel *frame; // The frame read last, width * height pixels
+	uint64_t time; // When it was swapped
+	uint64_t seq;
+	int flags;
+	// The rest is private
+	FILE *file;
+	int tileSize, tilesX, tilesY;
+	uint8_t *buffer; // One encoded tile
+	size_t bufferSize;
+	Pixel *tile; // One decoded tile
+} CaptureReader;
+
+// Returns NULL on failure
+CaptureReader *openCapture(const char *path);
+void closeCapture(CaptureReader *r);
+// Apply the next record to r->frame. If fbd isn't NULL, which must be the same size and in a damage mode,
+// the tiles that changed are also copied into its nextFrame and marked as damaged, ready for swap.
+// Returns 1 on success, 0 at the end of the file, -1 on failure.
+int readCapture(CaptureReader *r, FrameBufferDevice *fbd);
+
+#endif /* CAPTURE_H */
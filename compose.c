@@ -0,0 +1,213 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "compose.h"
+
+#define TRY(predicate) if(!(predicate)) goto fail
+
+// Mark the tiles covered by a rectangle of the screen
+static void markRect(Compositor *c, int x, int y, int w, int h) {
+	FrameBufferDevice *fbd = c->fbd;
+	if(x < 0) { w += x; x = 0; }
+	if(y < 0) { h += y; y = 0; }
+	if(x + w > fbd->xres) w = fbd->xres - x;
+	if(y + h > fbd->yres) h = fbd->yres - y;
+	if((w <= 0) || (h <= 0)) return;
+	for(int ty = y / FB_TILE_SIZE; ty <= (y + h - 1) / FB_TILE_SIZE; ty++) {
+		memset(c->damaged + (ty * fbd->tilesX) + (x / FB_TILE_SIZE), 1, ((x + w - 1) / FB_TILE_SIZE) - (x / FB_TILE_SIZE) + 1);
+	}
+}
+
+void damageLayer(Layer *layer, int x, int y, int w, int h) {
+	if((w <= 0) || (h <= 0)) return;
+	if(layer->changedX0 >= layer->changedX1) {
+		layer->changedX0 = x;
+		layer->changedY0 = y;
+		layer->changedX1 = x + w;
+		layer->changedY1 = y + h;
+		return;
+	}
+	if(x < layer->changedX0) layer->changedX0 = x;
+	if(y < layer->changedY0) layer->changedY0 = y;
+	if(x + w > layer->changedX1) layer->changedX1 = x + w;
+	if(y + h > layer->changedY1) layer->changedY1 = y + h;
+}
+
+static void layerDrawn(void *target, int x, int y, int w, int h) {
+	damageLayer(target, x, y, w, h);
+}
+
+Compositor *openCompositor(FrameBufferDevice *fbd) {
+	Compositor *c = NULL;
+	TRY(c = calloc(1, sizeof(Compositor)));
+	c->fbd = fbd;
+	c->background = (Pixel) {0, 0, 0, 255};
+	c->full = 1;
+	TRY(c->damaged = calloc(fbd->tilesX * fbd->tilesY, 1));
+	if(fbd->damageMode == FB_DAMAGE_FULL) fbd->damageMode = FB_DAMAGE_MANUAL;
+	return c;
+fail:
+	perror("openCompositor");
+	free(c);
+	return NULL;
+}
+
+void closeCompositor(Compositor *c) {
+	while(c->numLayers) removeLayer(c->layers[0]);
+	free(c->layers);
+	free(c->damaged);
+	free(c);
+}
+
+Layer *addLayer(Compositor *c, int width, int height, int z) {
+	Layer *layer = NULL;
+	Pixel *pixels = NULL;
+	if(c->numLayers == c->maxLayers) {
+		int max = c->maxLayers ? 2 * c->maxLayers : 8;
+		Layer **layers = realloc(c->layers, max * sizeof(Layer *));
+		TRY(layers);
+		c->layers = layers;
+		c->maxLayers = max;
+	}
+	TRY(layer = calloc(1, sizeof(Layer)));
+	TRY(!(errno = posix_memalign((void **)&pixels, 64, (size_t)width * height * sizeof(Pixel))));
+	memset(pixels, 0, (size_t)width * height * sizeof(Pixel));
+	layer->surface = imageSurface(pixels, width, height);
+	layer->surface.damage = layerDrawn;
+	layer->surface.damageTarget = layer;
+	layer->z = z;
+	layer->opacity = 255;
+	layer->visible = 1;
+	layer->compositor = c;
+	// Not shown yet, so the first composite draws it wherever it is by then
+	layer->shown.visible = 0;
+	c->layers[c->numLayers++] = layer;
+	return layer;
+fail:
+	perror("addLayer");
+	free(layer);
+	return NULL;
+}
+
+void removeLayer(Layer *layer) {
+	Compositor *c = layer->compositor;
+	if(layer->shown.visible) markRect(c, layer->shown.x, layer->shown.y, layer->shown.w, layer->shown.h);
+	for(int l = 0; l < c->numLayers; l++) {
+		if(c->layers[l] != layer) continue;
+		memmove(c->layers + l, c->layers + l + 1, (c->numLayers - l - 1) * sizeof(Layer *));
+		c->numLayers--;
+		break;
+	}
+	free(layer->surface.pixels);
+	free(layer);
+}
+
+// Compare a layer with how it was last composited and mark what needs redrawing
+static void findChanges(Compositor *c, Layer *layer) {
+	int visible = layer->visible && layer->opacity;
+	int w = layer->surface.width, h = layer->surface.height;
+	if((visible != layer->shown.visible) || (visible && ((layer->x != layer->shown.x) || (layer->y != layer->shown.y)
+			|| (w != layer->shown.w) || (h != layer->shown.h) || (layer->z != layer->shown.z) || (layer->opacity != layer->shown.opacity) || (layer->opaque != layer->shown.opaque)))) {
+		if(layer->shown.visible) markRect(c, layer->shown.x, layer->shown.y, layer->shown.w, layer->shown.h);
+		if(visible) markRect(c, layer->x, layer->y, w, h);
+	} else if(visible && (layer->changedX0 < layer->changedX1)) {
+		markRect(c, layer->x + layer->changedX0, layer->y + layer->changedY0, layer->changedX1 - layer->changedX0, layer->changedY1 - layer->changedY0);
+	}
+	layer->shown.x = layer->x;
+	layer->shown.y = layer->y;
+	layer->shown.w = w;
+	layer->shown.h = h;
+	layer->shown.z = layer->z;
+	layer->shown.opacity = layer->opacity;
+	layer->shown.opaque = layer->opaque;
+	layer->shown.visible = visible;
+	layer->changedX0 = layer->changedX1 = 0;
+}
+
+// Index of the top layer that hides everything beneath it in the rectangle, or -1
+static int occluder(const Compositor *c, int x, int y, int w, int h) {
+	// Tiles on the right edge can reach past the frame, which a full screen layer still covers (h is already clipped)
+	if(x + w > c->fbd->xres) w = c->fbd->xres - x;
+	for(int l = c->numLayers - 1; l >= 0; l--) {
+		const Layer *layer = c->layers[l];
+		if(!(layer->shown.visible && layer->shown.opaque && (layer->opacity == 255))) continue;
+		if((layer->x <= x) && (layer->y <= y) && (layer->x + layer->surface.width >= x + w) && (layer->y + layer->surface.height >= y + h)) return l;
+	}
+	return -1;
+}
+
+// Draw the layers from base up into a rectangle of out, or the background and all layers if base is -1
+static void compositeRect(Compositor *c, Surface *out, int base, int x, int y, int w, int h) {
+	if(base == -1) {
+		fillRect(out, x, y, w, h, c->background);
+		base = 0;
+	}
+	for(int l = base; l < c->numLayers; l++) {
+		Layer *layer = c->layers[l];
+		if(!layer->shown.visible) continue;
+		if(layer->shown.opaque && (layer->opacity == 255)) {
+			blitRect(out, x, y, &layer->surface, x - layer->x, y - layer->y, w, h);
+		} else {
+			blendBlitRectOpacity(out, x, y, &layer->surface, x - layer->x, y - layer->y, w, h, layer->opacity);
+		}
+	}
+}
+
+size_t composite(Compositor *c, Pixel *frame) {
+	FrameBufferDevice *fbd = c->fbd;
+	size_t pixels = 0;
+	// Sort by z, keeping the order layers were added in for equal z
+	for(int l = 1; l < c->numLayers; l++) {
+		Layer *layer = c->layers[l];
+		int k = l;
+		for(; (k > 0) && (c->layers[k - 1]->z > layer->z); k--) c->layers[k] = c->layers[k - 1];
+		c->layers[k] = layer;
+	}
+	for(int l = 0; l < c->numLayers; l++) findChanges(c, c->layers[l]);
+	if(c->full) memset(c->damaged, 1, fbd->tilesX * fbd->tilesY);
+	c->full = 0;
+	Surface out = imageSurface(frame, fbd->xres, fbd->yres);
+	out.stride = fbd->pitch;
+	for(int ty = 0; ty < fbd->tilesY; ty++) {
+		int y = ty * FB_TILE_SIZE;
+		int h = (y + FB_TILE_SIZE < fbd->yres) ? FB_TILE_SIZE : fbd->yres - y;
+		uint8_t *row = c->damaged + (ty * fbd->tilesX);
+		for(int tx = 0; tx < fbd->tilesX;) {
+			if(!row[tx]) {
+				tx++;
+				continue;
+			}
+			// Extend the run across damaged tiles that have the same occluding layer
+			int x = tx * FB_TILE_SIZE;
+			int base = occluder(c, x, y, FB_TILE_SIZE, h);
+			int end = tx + 1;
+			while((end < fbd->tilesX) && row[end] && (occluder(c, end * FB_TILE_SIZE, y, FB_TILE_SIZE, h) == base)) end++;
+			int w = ((end * FB_TILE_SIZE < fbd->xres) ? end * FB_TILE_SIZE : fbd->xres) - x;
+			compositeRect(c, &out, base, x, y, w, h);
+			fbd->damage(fbd, x, y, w, h);
+			pixels += (size_t)w * h;
+			memset(row + tx, 0, end - tx);
+			tx = end;
+		}
+	}
+	return pixels;
+}
@@ -0,0 +1,67 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPOSE_H
+#define COMPOSE_H 1
+
+#include "fb.h"
+#include "draw.h"
+
+// A surface stacked with others on the screen.
+// The public fields may be changed at any time: the compositor notices when they differ from what was last composited.
+typedef struct layer {
+	Surface surface; // The layer's pixels: drawing on it with draw.h marks the layer as changed
+	int x, y; // Position on the screen
+	int z; // Layers with higher z are drawn on top
+	uint8_t opacity; // Scales the alpha of every pixel, 255 leaves it unchanged
+	int visible;
+	int opaque; // Set if every pixel has alpha 255, so that the layer hides what is beneath it
+	// The rest is private
+	struct compositor *compositor;
+	struct {
+		int x, y, w, h, z, opacity, visible, opaque;
+	} shown; // As last composited
+	int changedX0, changedY0, changedX1, changedY1; // Bounding box of pixels changed since then
+} Layer;
+
+typedef struct compositor {
+	FrameBufferDevice *fbd;
+	Pixel background; // Shown where no layer covers the screen
+	// The rest is private
+	Layer **layers; // In z order as of the last composite
+	int numLayers, maxLayers;
+	uint8_t *damaged; // One flag per FB_TILE_SIZE tile of the screen
+	int full;
+} Compositor;
+
+// A compositor producing frames for fbd.
+// Only changed regions are composited, so fbd is switched to FB_DAMAGE_MANUAL if it tracks no damage:
+// frames passed to composite must keep the screen's contents, as nextFrame does in the damage modes.
+Compositor *openCompositor(FrameBufferDevice *fbd);
+void closeCompositor(Compositor *c); // Also frees all layers
+
+// A new transparent, visible layer at (0, 0), or NULL on failure
+Layer *addLayer(Compositor *c, int width, int height, int z);
+void removeLayer(Layer *layer);
+// Mark pixels of a layer as changed, for drawing that doesn't go through draw.h
+void damageLayer(Layer *layer, int x, int y, int w, int h);
+
+// Recomposite every region of frame where layers changed since the last call and mark it as damaged on the device.
+// Returns the number of pixels composited.
+size_t composite(Compositor *c, Pixel *frame);
+
+#endif /* COMPOSE_H */
@@ -0,0 +1,412 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "convert.h"
+
+#define R 0
+#define G 1
+#define B 2
+#define A 3
+
+int detectPixelFormat(PixelFormat *fmt, const struct fb_var_screeninfo *vinfo) {
+	const struct fb_bitfield *fields[4] = {&vinfo->red, &vinfo->green, &vinfo->blue, &vinfo->transp};
+	if((vinfo->bits_per_pixel != 16) && (vinfo->bits_per_pixel != 24) && (vinfo->bits_per_pixel != 32)) return 1;
+	fmt->bytesPerPixel = vinfo->bits_per_pixel / 8;
+	for(int c = 0; c < 4; c++) {
+		if(fields[c]->offset + fields[c]->length > vinfo->bits_per_pixel) return 1;
+		fmt->offset[c] = fields[c]->offset;
+		fmt->length[c] = fields[c]->length;
+	}
+	// A channel can't be missing from a colour screen
+	if(!(fmt->length[R] && fmt->length[G] && fmt->length[B])) return 1;
+	fmt->kernel = NULL;
+	return 0;
+}
+
+// Scale an 8 bit channel to len bits
+static inline uint32_t scaleChannel(uint8_t c, int len) {
+	if(len <= 8) return ((uint32_t)c) >> (8 - len);
+	uint32_t v = c;
+	int bits = 8;
+	while(bits < len) {
+		v = (v << 8) | c;
+		bits += 8;
+	}
+	return v >> (bits - len);
+}
+
+static inline uint32_t packPx(Pixel px, const PixelFormat *fmt) {
+	uint32_t out = 0;
+	if(fmt->length[R]) out |= scaleChannel(px.r, fmt->length[R]) << fmt->offset[R];
+	if(fmt->length[G]) out |= scaleChannel(px.g, fmt->length[G]) << fmt->offset[G];
+	if(fmt->length[B]) out |= scaleChannel(px.b, fmt->length[B]) << fmt->offset[B];
+	if(fmt->length[A]) out |= scaleChannel(px.a, fmt->length[A]) << fmt->offset[A];
+	return out;
+}
+
+// Any supported layout, one pixel at a time
+static void convertGeneric(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt) {
+	uint8_t *d = dst;
+	for(size_t i = 0; i < n; i++) {
+		uint32_t v = packPx(src[i], fmt);
+		for(int b = 0; b < fmt->bytesPerPixel; b++) {
+			*(d++) = v >> (8 * b);
+		}
+	}
+}
+
+static void convert32Scalar(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt) {
+	uint32_t *d = dst;
+	for(size_t i = 0; i < n; i++) d[i] = packPx(src[i], fmt);
+}
+
+static void convert16Scalar(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt) {
+	uint16_t *d = dst;
+	for(size_t i = 0; i < n; i++) d[i] = packPx(src[i], fmt);
+}
+
+#ifdef HAVE_X86
+// A Pixel loaded as a little endian uint32_t has channel c at bit 8 * c.
+// Each channel is shifted down to its length, masked and shifted up to its offset.
+typedef struct {
+	int used[4];
+	__m128i down[4], up[4], mask[4];
+} ShiftPlan;
+
+__attribute__((target("sse2")))
+static void planShifts(ShiftPlan *plan, const PixelFormat *fmt) {
+	for(int c = 0; c < 4; c++) {
+		plan->used[c] = fmt->length[c] != 0;
+		if(!plan->used[c]) continue;
+		plan->down[c] = _mm_cvtsi32_si128(8 * c + 8 - fmt->length[c]);
+		plan->up[c] = _mm_cvtsi32_si128(fmt->offset[c]);
+		plan->mask[c] = _mm_set1_epi32((1 << fmt->length[c]) - 1);
+	}
+}
+
+__attribute__((target("sse2")))
+static inline __m128i packSSE2(__m128i v, const ShiftPlan *plan) {
+	__m128i out = _mm_setzero_si128();
+	for(int c = 0; c < 4; c++) {
+		if(!plan->used[c]) continue;
+		out = _mm_or_si128(out, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, plan->down[c]), plan->mask[c]), plan->up[c]));
+	}
+	return out;
+}
+
+// Kernel bodies take a stream flag: when it is set the destination is aligned with scalar
+// stores first and then written with non-temporal stores that bypass the cache.
+// Call streamFence once the writes must be visible.
+#define STORE128(p, v, stream) ((stream) ? _mm_stream_si128((__m128i *)(p), (v)) : _mm_storeu_si128((__m128i *)(p), (v)))
+#define STORE256(p, v, stream) ((stream) ? _mm256_stream_si256((__m256i *)(p), (v)) : _mm256_storeu_si256((__m256i *)(p), (v)))
+#define ALIGN_HEAD(d, i, n, align, stream, px) if(stream) for(; ((i) < (n)) && (((uintptr_t)((d) + (i))) & ((align) - 1)); (i)++) (d)[i] = (px)
+
+// Define the cached and non-temporal entry points for a kernel body
+#define KERNELS(name, isa) \
+	__attribute__((target(isa))) static void name(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt) { \
+		name##Body(dst, src, n, fmt, 0); \
+	} \
+	__attribute__((target(isa))) static void name##NT(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt) { \
+		name##Body(dst, src, n, fmt, 1); \
+	}
+
+__attribute__((target("sse2"), always_inline))
+static inline void convert32SSE2Body(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt, int stream) {
+	ShiftPlan plan;
+	planShifts(&plan, fmt);
+	uint32_t *d = dst;
+	size_t i = 0;
+	ALIGN_HEAD(d, i, n, 16, stream, packPx(src[i], fmt));
+	for(; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		STORE128(d + i, packSSE2(v, &plan), stream);
+	}
+	convert32Scalar(d + i, src + i, n - i, fmt);
+}
+
+KERNELS(convert32SSE2, "sse2")
+
+__attribute__((target("sse2"), always_inline))
+static inline void convert16SSE2Body(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt, int stream) {
+	ShiftPlan plan;
+	planShifts(&plan, fmt);
+	uint16_t *d = dst;
+	size_t i = 0;
+	ALIGN_HEAD(d, i, n, 16, stream, packPx(src[i], fmt));
+	for(; i + 8 <= n; i += 8) {
+		__m128i lo = packSSE2(_mm_loadu_si128((const __m128i *)(src + i)), &plan);
+		__m128i hi = packSSE2(_mm_loadu_si128((const __m128i *)(src + i + 4)), &plan);
+		// Sign extend so that the saturating pack keeps all 16 bits
+		lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+		hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+		STORE128(d + i, _mm_packs_epi32(lo, hi), stream);
+	}
+	convert16Scalar(d + i, src + i, n - i, fmt);
+}
+
+KERNELS(convert16SSE2, "sse2")
+
+// Build a byte shuffle for layouts where every channel is a whole byte.
+// Output byte b of pixel p comes from source byte 4p + c, or is zeroed.
+static void planShuffle(uint8_t shuffle[16], const PixelFormat *fmt, int bpp) {
+	memset(shuffle, 0x80, 16);
+	for(int p = 0; p < 16 / 4; p++) {
+		for(int c = 0; c < 4; c++) {
+			if(!fmt->length[c]) continue;
+			int b = bpp * p + fmt->offset[c] / 8;
+			if(b < 16) shuffle[b] = 4 * p + c;
+		}
+	}
+}
+
+__attribute__((target("ssse3")))
+static void convert24SSSE3(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt) {
+	uint8_t s[16];
+	planShuffle(s, fmt, 3);
+	__m128i shuffle = _mm_loadu_si128((const __m128i *)s);
+	uint8_t *d = dst;
+	size_t i = 0;
+	// Each step writes 16 bytes but only advances 12, so stop while a whole step still fits
+	for(; i + 6 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(d + 3 * i), _mm_shuffle_epi8(v, shuffle));
+	}
+	convertGeneric(d + 3 * i, src + i, n - i, fmt);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void convert32AVX2Body(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt, int stream) {
+	uint8_t s[16];
+	planShuffle(s, fmt, 4);
+	__m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)s));
+	uint32_t *d = dst;
+	size_t i = 0;
+	ALIGN_HEAD(d, i, n, 32, stream, packPx(src[i], fmt));
+	for(; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		STORE256(d + i, _mm256_shuffle_epi8(v, shuffle), stream);
+	}
+	convert32Scalar(d + i, src + i, n - i, fmt);
+}
+
+KERNELS(convert32AVX2, "avx2")
+
+__attribute__((target("avx2")))
+static inline __m256i packAVX2(__m256i v, const ShiftPlan *plan) {
+	__m256i out = _mm256_setzero_si256();
+	for(int c = 0; c < 4; c++) {
+		if(!plan->used[c]) continue;
+		__m256i t = _mm256_and_si256(_mm256_srl_epi32(v, plan->down[c]), _mm256_broadcastsi128_si256(plan->mask[c]));
+		out = _mm256_or_si256(out, _mm256_sll_epi32(t, plan->up[c]));
+	}
+	return out;
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void convert16AVX2Body(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt, int stream) {
+	ShiftPlan plan;
+	planShifts(&plan, fmt);
+	uint16_t *d = dst;
+	size_t i = 0;
+	ALIGN_HEAD(d, i, n, 32, stream, packPx(src[i], fmt));
+	for(; i + 16 <= n; i += 16) {
+		__m256i lo = packAVX2(_mm256_loadu_si256((const __m256i *)(src + i)), &plan);
+		__m256i hi = packAVX2(_mm256_loadu_si256((const __m256i *)(src + i + 8)), &plan);
+		lo = _mm256_srai_epi32(_mm256_slli_epi32(lo, 16), 16);
+		hi = _mm256_srai_epi32(_mm256_slli_epi32(hi, 16), 16);
+		// The pack works within 128 bit lanes, so put the quadwords back in order afterwards
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+		STORE256(d + i, packed, stream);
+	}
+	convert16Scalar(d + i, src + i, n - i, fmt);
+}
+
+KERNELS(convert16AVX2, "avx2")
+#endif /* HAVE_X86 */
+
+#ifdef __ARM_NEON
+// Output byte b takes the channel at bit offset 8b, or zero
+static void planBytes(int from[4], const PixelFormat *fmt) {
+	for(int b = 0; b < 4; b++) from[b] = -1;
+	for(int c = 0; c < 4; c++) {
+		if(fmt->length[c]) from[fmt->offset[c] / 8] = c;
+	}
+}
+
+static void convert32NEON(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt) {
+	int from[4];
+	planBytes(from, fmt);
+	uint8_t *d = dst;
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)(src + i));
+		uint8x16x4_t out;
+		for(int b = 0; b < 4; b++) out.val[b] = (from[b] < 0) ? vdupq_n_u8(0) : v.val[from[b]];
+		vst4q_u8(d + 4 * i, out);
+	}
+	convert32Scalar(d + 4 * i, src + i, n - i, fmt);
+}
+
+static void convert24NEON(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt) {
+	int from[4];
+	planBytes(from, fmt);
+	uint8_t *d = dst;
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)(src + i));
+		uint8x16x3_t out;
+		for(int b = 0; b < 3; b++) out.val[b] = (from[b] < 0) ? vdupq_n_u8(0) : v.val[from[b]];
+		vst3q_u8(d + 3 * i, out);
+	}
+	convertGeneric(d + 3 * i, src + i, n - i, fmt);
+}
+
+static void convert16NEON(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt) {
+	int16x8_t down[4], up[4];
+	for(int c = 0; c < 4; c++) {
+		down[c] = vdupq_n_s16(fmt->length[c] - 8); // Negative shifts go right
+		up[c] = vdupq_n_s16(fmt->offset[c]);
+	}
+	uint16_t *d = dst;
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)(src + i));
+		uint16x8_t lo = vdupq_n_u16(0), hi = vdupq_n_u16(0);
+		for(int c = 0; c < 4; c++) {
+			if(!fmt->length[c]) continue;
+			lo = vorrq_u16(lo, vshlq_u16(vshlq_u16(vmovl_u8(vget_low_u8(v.val[c])), down[c]), up[c]));
+			hi = vorrq_u16(hi, vshlq_u16(vshlq_u16(vmovl_u8(vget_high_u8(v.val[c])), down[c]), up[c]));
+		}
+		vst1q_u16(d + i, lo);
+		vst1q_u16(d + i + 8, hi);
+	}
+	convert16Scalar(d + i, src + i, n - i, fmt);
+}
+#endif /* __ARM_NEON */
+
+// Every channel is 8 bits on a byte boundary, so conversion is a byte shuffle
+static int byteAligned(const PixelFormat *fmt) {
+	for(int c = 0; c < 4; c++) {
+		if(fmt->length[c] && ((fmt->length[c] != 8) || (fmt->offset[c] % 8))) return 0;
+	}
+	return 1;
+}
+
+static int fitsBytes(const PixelFormat *fmt) {
+	for(int c = 0; c < 4; c++) {
+		if(fmt->length[c] > 8) return 0;
+	}
+	return 1;
+}
+
+void streamFence(void) {
+#ifdef HAVE_X86
+	_mm_sfence();
+#endif
+}
+
+// Layouts a kernel handles
+#define ANY_LAYOUT 0
+#define FITS_BYTES 1
+#define BYTE_ALIGNED 2
+
+// CPU features a kernel needs
+#define ISA_NONE 0
+#define ISA_SSE2 1
+#define ISA_SSSE3 2
+#define ISA_AVX2 3
+
+typedef struct kernel {
+	const char *name;
+	int isa;
+	int bytesPerPixel; // 0 for any
+	int layout;
+	PixelConverter convert;
+} Kernel;
+
+// In order of preference
+static const Kernel kernels[] = {
+#ifdef HAVE_X86
+	{"avx2-nt", ISA_AVX2, 4, BYTE_ALIGNED, convert32AVX2NT},
+	{"avx2", ISA_AVX2, 4, BYTE_ALIGNED, convert32AVX2},
+	{"sse2-nt", ISA_SSE2, 4, FITS_BYTES, convert32SSE2NT},
+	{"sse2", ISA_SSE2, 4, FITS_BYTES, convert32SSE2},
+	{"avx2-nt", ISA_AVX2, 2, FITS_BYTES, convert16AVX2NT},
+	{"avx2", ISA_AVX2, 2, FITS_BYTES, convert16AVX2},
+	{"sse2-nt", ISA_SSE2, 2, FITS_BYTES, convert16SSE2NT},
+	{"sse2", ISA_SSE2, 2, FITS_BYTES, convert16SSE2},
+	{"ssse3", ISA_SSSE3, 3, BYTE_ALIGNED, convert24SSSE3},
+#endif
+#ifdef __ARM_NEON
+	{"neon", ISA_NONE, 4, BYTE_ALIGNED, convert32NEON},
+	{"neon", ISA_NONE, 2, FITS_BYTES, convert16NEON},
+	{"neon", ISA_NONE, 3, BYTE_ALIGNED, convert24NEON},
+#endif
+	{"scalar", ISA_NONE, 4, FITS_BYTES, convert32Scalar},
+	{"scalar", ISA_NONE, 2, FITS_BYTES, convert16Scalar},
+	{"generic", ISA_NONE, 0, ANY_LAYOUT, convertGeneric},
+};
+
+static int cpuHas(int isa) {
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	switch(isa) {
+	case ISA_SSE2: return __builtin_cpu_supports("sse2");
+	case ISA_SSSE3: return __builtin_cpu_supports("ssse3");
+	case ISA_AVX2: return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return isa == ISA_NONE;
+}
+
+static int usable(const Kernel *k, const PixelFormat *fmt) {
+	if(k->bytesPerPixel && (k->bytesPerPixel != fmt->bytesPerPixel)) return 0;
+	if((k->layout == FITS_BYTES) && !fitsBytes(fmt)) return 0;
+	if((k->layout == BYTE_ALIGNED) && !byteAligned(fmt)) return 0;
+	return cpuHas(k->isa);
+}
+
+PixelConverter selectConverter(PixelFormat *fmt, int stream) {
+	for(size_t k = 0; k < sizeof(kernels) / sizeof(Kernel); k++) {
+		// Non-temporal kernels are named with -nt
+		if(!stream && strstr(kernels[k].name, "-nt")) continue;
+		if(!usable(&kernels[k], fmt)) continue;
+		fmt->kernel = kernels[k].name;
+		return kernels[k].convert;
+	}
+	return NULL; // Not reached: the generic kernel handles everything
+}
+
+PixelConverter findConverter(PixelFormat *fmt, const char *name) {
+	for(size_t k = 0; k < sizeof(kernels) / sizeof(Kernel); k++) {
+		if(strcmp(kernels[k].name, name) || !usable(&kernels[k], fmt)) continue;
+		fmt->kernel = kernels[k].name;
+		return kernels[k].convert;
+	}
+	return NULL;
+}
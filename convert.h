@@ -0,0 +1,39 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H 1
+
+// Scanline pixel format conversion, used internally by fb.c
+
+#include <linux/fb.h>
+
+#include "fb.h"
+
+// Fill in fmt from the screen's bitfields, returns non-zero if the layout is unsupported
+int detectPixelFormat(PixelFormat *fmt, const struct fb_var_screeninfo *vinfo);
+
+// Pick the fastest conversion kernel for fmt that the CPU supports and set fmt->kernel to its name
+// If stream is non-zero prefer kernels that write with non-temporal stores: use these for the framebuffer
+PixelConverter selectConverter(PixelFormat *fmt, int stream);
+// The kernel called name if it handles fmt on this CPU (setting fmt->kernel), otherwise NULL
+PixelConverter findConverter(PixelFormat *fmt, const char *name);
+
+// Order non-temporal stores made by a streaming kernel before anything that follows
+void streamFence(void);
+
+#endif /* CONVERT_H */
@@ -0,0 +1,342 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "draw.h"
+
+// Span kernels, chosen once for the CPU
+static void (*fillSpan)(Pixel *dst, Pixel colour, size_t n);
+static void (*blendSpan)(Pixel *dst, const Pixel *src, size_t n);
+static pthread_once_t kernelsChosen = PTHREAD_ONCE_INIT;
+
+// Exact round(x / 255) for x <= 255 * 255
+static inline uint32_t div255(uint32_t x) {
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline Pixel over(Pixel s, Pixel d) {
+	uint32_t a = s.a, ia = 255 - a;
+	return (Pixel) {
+		.r = div255(s.r * a + d.r * ia),
+		.g = div255(s.g * a + d.g * ia),
+		.b = div255(s.b * a + d.b * ia),
+		.a = div255(255 * a + d.a * ia),
+	};
+}
+
+static void fillSpanScalar(Pixel *dst, Pixel colour, size_t n) {
+	for(size_t i = 0; i < n; i++) dst[i] = colour;
+}
+
+static void blendSpanScalar(Pixel *dst, const Pixel *src, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		if(src[i].a == 255) dst[i] = src[i];
+		else if(src[i].a) dst[i] = over(src[i], dst[i]);
+	}
+}
+
+#ifdef HAVE_X86
+// Each kernel aligns dst with scalar steps so that the vector stores don't split cache lines
+#define ALIGN_HEAD(dst, i, n, align, step) for(; ((i) < (n)) && (((uintptr_t)((dst) + (i))) & ((align) - 1)); (i)++) step
+
+__attribute__((target("sse2")))
+static void fillSpanSSE2(Pixel *dst, Pixel colour, size_t n) {
+	uint32_t c;
+	memcpy(&c, &colour, sizeof(c));
+	__m128i v = _mm_set1_epi32(c);
+	size_t i = 0;
+	ALIGN_HEAD(dst, i, n, 16, dst[i] = colour);
+	for(; i + 4 <= n; i += 4) _mm_store_si128((__m128i *)(dst + i), v);
+	fillSpanScalar(dst + i, colour, n - i);
+}
+
+// Blend the 2 pixels in each half of s over d, with channels widened to 16 bits
+__attribute__((target("sse2")))
+static inline __m128i over16SSE2(__m128i s, __m128i d, __m128i opaqueAlpha) {
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+	__m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), a);
+	// Alpha is blended as if the source alpha channel were 255
+	s = _mm_or_si128(s, opaqueAlpha);
+	__m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia)), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void blendSpanSSE2(Pixel *dst, const Pixel *src, size_t n) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	const __m128i opaqueAlpha = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	size_t i = 0;
+	ALIGN_HEAD(dst, i, n, 16, blendSpanScalar(dst + i, src + i, 1));
+	for(; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		int opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha), alpha));
+		if(opaque == 0xffff) {
+			_mm_store_si128((__m128i *)(dst + i), s);
+			continue;
+		}
+		if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha), zero)) == 0xffff) continue;
+		__m128i d = _mm_load_si128((const __m128i *)(dst + i));
+		__m128i lo = over16SSE2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), opaqueAlpha);
+		__m128i hi = over16SSE2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), opaqueAlpha);
+		_mm_store_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+	blendSpanScalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void fillSpanAVX2(Pixel *dst, Pixel colour, size_t n) {
+	uint32_t c;
+	memcpy(&c, &colour, sizeof(c));
+	__m256i v = _mm256_set1_epi32(c);
+	size_t i = 0;
+	ALIGN_HEAD(dst, i, n, 32, dst[i] = colour);
+	for(; i + 8 <= n; i += 8) _mm256_store_si256((__m256i *)(dst + i), v);
+	fillSpanScalar(dst + i, colour, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i over16AVX2(__m256i s, __m256i d, __m256i opaqueAlpha) {
+	__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+	__m256i ia = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+	s = _mm256_or_si256(s, opaqueAlpha);
+	__m256i t = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, ia)), _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void blendSpanAVX2(Pixel *dst, const Pixel *src, size_t n) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	const __m256i opaqueAlpha = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+	size_t i = 0;
+	ALIGN_HEAD(dst, i, n, 32, blendSpanScalar(dst + i, src + i, 1));
+	for(; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i sa = _mm256_and_si256(s, alpha);
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, alpha)) == -1) {
+			_mm256_store_si256((__m256i *)(dst + i), s);
+			continue;
+		}
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, zero)) == -1) continue;
+		__m256i d = _mm256_load_si256((const __m256i *)(dst + i));
+		// Unpacking and packing both work within 128 bit lanes, so pixel order is preserved
+		__m256i lo = over16AVX2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero), opaqueAlpha);
+		__m256i hi = over16AVX2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero), opaqueAlpha);
+		_mm256_store_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+	}
+	blendSpanScalar(dst + i, src + i, n - i);
+}
+#endif /* HAVE_X86 */
+
+#ifdef __ARM_NEON
+static void fillSpanNEON(Pixel *dst, Pixel colour, size_t n) {
+	uint32_t c;
+	memcpy(&c, &colour, sizeof(c));
+	uint32x4_t v = vdupq_n_u32(c);
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) vst1q_u32((uint32_t *)(dst + i), v);
+	fillSpanScalar(dst + i, colour, n - i);
+}
+
+// round((s * a + d * ia) / 255) for 8 lanes, the same rounding as div255
+static inline uint8x8_t overNEON(uint8x8_t s, uint8x8_t d, uint8x8_t a, uint8x8_t ia) {
+	uint16x8_t t = vmlal_u8(vmull_u8(s, a), d, ia);
+	return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static void blendSpanNEON(Pixel *dst, const Pixel *src, size_t n) {
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		uint8x8x4_t s = vld4_u8((const uint8_t *)(src + i));
+		uint8x8x4_t d = vld4_u8((const uint8_t *)(dst + i));
+		uint8x8_t ia = vmvn_u8(s.val[3]);
+		uint8x8x4_t out;
+		for(int c = 0; c < 3; c++) out.val[c] = overNEON(s.val[c], d.val[c], s.val[3], ia);
+		out.val[3] = overNEON(vdup_n_u8(255), d.val[3], s.val[3], ia);
+		vst4_u8((uint8_t *)(dst + i), out);
+	}
+	blendSpanScalar(dst + i, src + i, n - i);
+}
+#endif /* __ARM_NEON */
+
+static void chooseKernels(void) {
+	fillSpan = fillSpanScalar;
+	blendSpan = blendSpanScalar;
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		fillSpan = fillSpanSSE2;
+		blendSpan = blendSpanSSE2;
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		fillSpan = fillSpanAVX2;
+		blendSpan = blendSpanAVX2;
+	}
+#endif
+#ifdef __ARM_NEON
+	fillSpan = fillSpanNEON;
+	blendSpan = blendSpanNEON;
+#endif
+}
+
+static void damageDevice(void *target, int x, int y, int w, int h) {
+	FrameBufferDevice *fbd = target;
+	fbd->damage(fbd, x, y, w, h);
+}
+
+Surface frameSurface(FrameBufferDevice *fbd, Pixel *frame) {
+	return (Surface) {
+		.pixels = frame,
+		.width = fbd->xres,
+		.height = fbd->yres,
+		.stride = fbd->pitch,
+		.damage = damageDevice,
+		.damageTarget = fbd,
+	};
+}
+
+Surface imageSurface(Pixel *pixels, int width, int height) {
+	return (Surface) {
+		.pixels = pixels,
+		.width = width,
+		.height = height,
+		.stride = width,
+		.damage = NULL,
+		.damageTarget = NULL,
+	};
+}
+
+// Clip the rectangle at (x, y) on s, moving (sx, sy) along with it if not NULL.
+// Returns 0 if nothing is left.
+static int clip(const Surface *s, int *x, int *y, int *w, int *h, int *sx, int *sy) {
+	if(*x < 0) {
+		*w += *x;
+		if(sx) *sx -= *x;
+		*x = 0;
+	}
+	if(*y < 0) {
+		*h += *y;
+		if(sy) *sy -= *y;
+		*y = 0;
+	}
+	if(*x + *w > s->width) *w = s->width - *x;
+	if(*y + *h > s->height) *h = s->height - *y;
+	return (*w > 0) && (*h > 0);
+}
+
+// Clip a blit to both surfaces
+static int clipBlit(const Surface *dst, int *x, int *y, const Surface *src, int *sx, int *sy, int *w, int *h) {
+	return clip(src, sx, sy, w, h, x, y) && clip(dst, x, y, w, h, sx, sy);
+}
+
+static void damaged(Surface *dst, int x, int y, int w, int h) {
+	if(dst->damage) dst->damage(dst->damageTarget, x, y, w, h);
+}
+
+void fillRect(Surface *dst, int x, int y, int w, int h, Pixel colour) {
+	pthread_once(&kernelsChosen, chooseKernels);
+	if(!clip(dst, &x, &y, &w, &h, NULL, NULL)) return;
+	for(int row = y; row < y + h; row++) fillSpan(dst->pixels + ((size_t)row * dst->stride) + x, colour, w);
+	damaged(dst, x, y, w, h);
+}
+
+void blendRect(Surface *dst, int x, int y, int w, int h, Pixel colour) {
+	if(colour.a == 255) {
+		fillRect(dst, x, y, w, h, colour);
+		return;
+	}
+	if(!colour.a) return;
+	pthread_once(&kernelsChosen, chooseKernels);
+	if(!clip(dst, &x, &y, &w, &h, NULL, NULL)) return;
+	// Blend from a short run of the colour, so the per-pixel kernel can be used
+	Pixel run[64];
+	fillSpanScalar(run, colour, 64);
+	for(int row = y; row < y + h; row++) {
+		Pixel *p = dst->pixels + ((size_t)row * dst->stride) + x;
+		for(int i = 0; i < w; i += 64) blendSpan(p + i, run, (w - i < 64) ? w - i : 64);
+	}
+	damaged(dst, x, y, w, h);
+}
+
+void drawHLine(Surface *dst, int x, int y, int len, Pixel colour) {
+	fillRect(dst, x, y, len, 1, colour);
+}
+
+void drawVLine(Surface *dst, int x, int y, int len, Pixel colour) {
+	int w = 1;
+	if(!clip(dst, &x, &y, &w, &len, NULL, NULL)) return;
+	for(int row = y; row < y + len; row++) dst->pixels[((size_t)row * dst->stride) + x] = colour;
+	damaged(dst, x, y, 1, len);
+}
+
+void blitRect(Surface *dst, int x, int y, const Surface *src, int sx, int sy, int w, int h) {
+	if(!clipBlit(dst, &x, &y, src, &sx, &sy, &w, &h)) return;
+	// Go bottom up when copying downwards within the same pixels, in case the rectangles overlap
+	int up = (dst->pixels == src->pixels) && (y > sy);
+	for(int i = 0; i < h; i++) {
+		int row = up ? h - 1 - i : i;
+		memmove(dst->pixels + ((size_t)(y + row) * dst->stride) + x, src->pixels + ((size_t)(sy + row) * src->stride) + sx, w * sizeof(Pixel));
+	}
+	damaged(dst, x, y, w, h);
+}
+
+void blendBlitRect(Surface *dst, int x, int y, const Surface *src, int sx, int sy, int w, int h) {
+	pthread_once(&kernelsChosen, chooseKernels);
+	if(!clipBlit(dst, &x, &y, src, &sx, &sy, &w, &h)) return;
+	for(int row = 0; row < h; row++) {
+		blendSpan(dst->pixels + ((size_t)(y + row) * dst->stride) + x, src->pixels + ((size_t)(sy + row) * src->stride) + sx, w);
+	}
+	damaged(dst, x, y, w, h);
+}
+
+void blendBlitRectOpacity(Surface *dst, int x, int y, const Surface *src, int sx, int sy, int w, int h, uint8_t opacity) {
+	if(opacity == 255) {
+		blendBlitRect(dst, x, y, src, sx, sy, w, h);
+		return;
+	}
+	if(!opacity) return;
+	pthread_once(&kernelsChosen, chooseKernels);
+	if(!clipBlit(dst, &x, &y, src, &sx, &sy, &w, &h)) return;
+	// Scale alpha into a short run of pixels, then blend that
+	Pixel run[64];
+	for(int row = 0; row < h; row++) {
+		Pixel *d = dst->pixels + ((size_t)(y + row) * dst->stride) + x;
+		const Pixel *s = src->pixels + ((size_t)(sy + row) * src->stride) + sx;
+		for(int i = 0; i < w; i += 64) {
+			int n = (w - i < 64) ? w - i : 64;
+			for(int p = 0; p < n; p++) {
+				run[p] = s[i + p];
+				run[p].a = div255(run[p].a * opacity);
+			}
+			blendSpan(d + i, run, n);
+		}
+	}
+	damaged(dst, x, y, w, h);
+}
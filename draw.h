@@ -0,0 +1,54 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRAW_H
+#define DRAW_H 1
+
+#include "fb.h"
+
+// A rectangle of pixels to draw on: a frame of a FrameBufferDevice or any other image
+typedef struct surface {
+	Pixel *pixels;
+	int width, height;
+	int stride; // Pixels from the start of one row to the start of the next
+	// If not NULL, called with every rectangle that drawing changes
+	void (*damage)(void *target, int x, int y, int w, int h);
+	void *damageTarget;
+} Surface;
+
+// A surface covering frame (usually nextFrame, or a frame from acquireFrameFBDev) that marks damage on fbd
+Surface frameSurface(FrameBufferDevice *fbd, Pixel *frame);
+// A surface covering an image of width * height pixels
+Surface imageSurface(Pixel *pixels, int width, int height);
+
+// Everything is clipped to the surfaces involved.
+// The blend functions composite with Porter-Duff "over" using the source alpha (a = 255 is opaque):
+// colours become src * a + dst * (1 - a), and alpha becomes a + dst.a * (1 - a).
+
+void fillRect(Surface *dst, int x, int y, int w, int h, Pixel colour);
+void blendRect(Surface *dst, int x, int y, int w, int h, Pixel colour);
+void drawHLine(Surface *dst, int x, int y, int len, Pixel colour);
+void drawVLine(Surface *dst, int x, int y, int len, Pixel colour);
+
+// Copy or blend the w * h rectangle of src at (sx, sy) to (x, y) on dst.
+// src and dst may overlap for blitRect, but not for blendBlitRect.
+void blitRect(Surface *dst, int x, int y, const Surface *src, int sx, int sy, int w, int h);
+void blendBlitRect(Surface *dst, int x, int y, const Surface *src, int sx, int sy, int w, int h);
+// As blendBlitRect, with the source alpha scaled by opacity / 255
+void blendBlitRectOpacity(Surface *dst, int x, int y, const Surface *src, int sx, int sy, int w, int h, uint8_t opacity);
+
+#endif /* DRAW_H */
@@ -15,6 +15,7 @@
  *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <fcntl.h>
 #include <linux/fb.h>
@@ -27,11 +28,72 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include "fb.h"
+#include "convert.h"
+#include "scale.h"
+#include "rotate.h"
+#include "capture.h"
+#include "latency.h"
 
 #define TRY(predicate) if(!(predicate)) goto fail
 
+// Bits in FrameBufferDevice.damaged
+#define DAMAGE_NOW 1 // Changed since the last swap
+#define DAMAGE_PREV 2 // Changed before the last swap
+
+// Frame states in a PresentQueue
+#define FRAME_FREE 0
+#define FRAME_ACQUIRED 1 // Being drawn by the application
+#define FRAME_PENDING 2 // Submitted but not yet presented
+#define FRAME_BUSY 3 // Being presented, or on screen
+
+typedef struct swapWorker {
+	pthread_t thread;
+	int id;
+	FrameBufferDevice *fbd;
+} SwapWorker;
+
+struct swapWorkers {
+	int numThreads; // Including the thread that swaps
+	SwapWorker *threads; // threads[0] is unused
+	pthread_mutex_t lock;
+	pthread_cond_t start; // Signalled when generation changes or the workers should stop
+	pthread_cond_t finished; // Signalled when remaining reaches 0
+	int running;
+	uint64_t generation;
+	uint8_t mask;
+	int remaining;
+	size_t written;
+};
+
+struct presentQueue {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; // Signalled when a frame is submitted or the thread should stop
+	pthread_cond_t done; // Signalled when a frame is presented or freed
+	int running;
+	int numFrames;
+	Pixel **frames;
+	int *state;
+	int pending; // Index of the pending frame, or -1
+	int shown; // Index of the frame on screen
+	uint64_t pendingSeq, submittedSeq, presentedSeq;
+	uint64_t dropped;
+	uint8_t *marked; // Damage marked since the last submission
+	uint8_t *submitted; // Damage of submitted frames that haven't been presented yet
+};
+
+struct frameStats {
+	pthread_mutex_t lock; // Swaps can happen on the present thread while the application reads statistics
+	SwapStats stats;
+	int next; // Index in stats.recent that the next swap goes into, which is the oldest once numRecent is FB_STATS_HISTORY
+	uint64_t lastStart, lastEnd;
+};
+
 static int activevt(void) {
 	struct vt_stat vts;
 	TRY(ioctl(0, VT_GETSTATE, &vts) == 0);
@@ -41,37 +103,800 @@ fail:
 	return -1;
 }
 
+// The console stays in graphics mode while any device that switched it is open
+static pthread_mutex_t consoleLock = PTHREAD_MUTEX_INITIALIZER;
+static int consoleUsers;
+
 static int setGraphics(void) {
-	TRY(ioctl(0, KDSETMODE, KD_GRAPHICS) == 0);
+	pthread_mutex_lock(&consoleLock);
+	TRY(consoleUsers || (ioctl(0, KDSETMODE, KD_GRAPHICS) == 0));
+	consoleUsers++;
+	pthread_mutex_unlock(&consoleLock);
 	return 0;
 fail:
+	pthread_mutex_unlock(&consoleLock);
 	perror("setGraphics");
 	return 1;
 }
 
+static void setText(void) {
+	pthread_mutex_lock(&consoleLock);
+	if(!--consoleUsers && ioctl(0, KDSETMODE, KD_TEXT)) perror("closeFBDev");
+	pthread_mutex_unlock(&consoleLock);
+}
+
+static int panTo(FrameBufferDevice *fbd, int page);
+
+// Frames start on a cache line so that vector code working along rows stays aligned
+static Pixel *allocFrame(size_t size) {
+	void *frame;
+	if((errno = posix_memalign(&frame, 64, size))) return NULL;
+	return memset(frame, 0, size);
+}
+
 void closeFBDev(FrameBufferDevice *fbd) {
 	assert(fbd);
+	stopPresentFBDev(fbd);
+	stopSwapWorkersFBDev(fbd);
+	stopStatsFBDev(fbd);
+	stopCaptureFBDev(fbd);
+	stopLatencyTraceFBDev(fbd);
+	if((fbd->presentMode == FB_PRESENT_FLIP) && panTo(fbd, 0)) perror("closeFBDev");
 	if((fbd->direct != MAP_FAILED) && (munmap(fbd->direct, fbd->directSize) == -1)) perror("closeFBDev");
-	if(fbd->lastFrame) free(fbd->lastFrame);
-	if(fbd->nextFrame) free(fbd->nextFrame);
-	if(fbd->swapBuffer) free(fbd->swapBuffer);
+	if(!fbd->spanned) {
+		free(fbd->lastFrame);
+		free(fbd->nextFrame);
+	}
+	if(fbd->damaged) free(fbd->damaged);
 	if((fbd->fd != -1) && (close(fbd->fd) == -1)) perror("closeFBDev");
-	if((fbd->modeset) && ioctl(0, KDSETMODE, KD_TEXT)) perror("closeFBDev");
+	if(fbd->modeset) setText();
 	free(fbd);
 }
 
-void swapFBDev(FrameBufferDevice *fbd) {
+static void markTiles(const FrameBufferDevice *fbd, uint8_t *map, int x, int y, int w, int h) {
+	// Clip to the screen
+	if(x < 0) { w += x; x = 0; }
+	if(y < 0) { h += y; y = 0; }
+	if(x + w > fbd->xres) w = fbd->xres - x;
+	if(y + h > fbd->yres) h = fbd->yres - y;
+	if((w <= 0) || (h <= 0)) return;
+	for(int ty = y / FB_TILE_SIZE; ty <= (y + h - 1) / FB_TILE_SIZE; ty++) {
+		uint8_t *row = map + (ty * fbd->tilesX);
+		for(int tx = x / FB_TILE_SIZE; tx <= (x + w - 1) / FB_TILE_SIZE; tx++) row[tx] |= DAMAGE_NOW;
+	}
+}
+
+static void damageFBDev(FrameBufferDevice *fbd, int x, int y, int w, int h) {
 	assert(fbd);
-	for(size_t line = 0; line < fbd->yres; line++) {
-		uint32_t *l = (uint32_t *) (((char *)fbd->swapBuffer) + (line * fbd->lineLen));
-		for(size_t px = 0; px < fbd->xres; px++) {
-			l[px] = fbd->formatPx(fbd->nextFrame[line * fbd->xres + px]);
+	if(fbd->async) {
+		// The present thread owns damaged: keep marks for the next submitted frame
+		pthread_mutex_lock(&fbd->async->lock);
+		markTiles(fbd, fbd->async->marked, x, y, w, h);
+		pthread_mutex_unlock(&fbd->async->lock);
+	} else {
+		markTiles(fbd, fbd->damaged, x, y, w, h);
+	}
+}
+
+// Mark tiles in tile rows [ty0, ty1) where nextFrame differs from lastFrame (what is currently on screen)
+static void diffTiles(FrameBufferDevice *fbd, int ty0, int ty1) {
+	for(int ty = ty0; ty < ty1; ty++) {
+		int y0 = ty * FB_TILE_SIZE;
+		int y1 = (y0 + FB_TILE_SIZE < fbd->yres) ? y0 + FB_TILE_SIZE : fbd->yres;
+		for(int tx = 0; tx < fbd->tilesX; tx++) {
+			if(fbd->damaged[ty * fbd->tilesX + tx] & DAMAGE_NOW) continue;
+			int x0 = tx * FB_TILE_SIZE;
+			int w = (x0 + FB_TILE_SIZE < fbd->xres) ? FB_TILE_SIZE : fbd->xres - x0;
+			for(int line = y0; line < y1; line++) {
+				size_t off = (size_t)line * fbd->pitch + x0;
+				if(memcmp(fbd->nextFrame + off, fbd->lastFrame + off, w * sizeof(Pixel))) {
+					fbd->damaged[ty * fbd->tilesX + tx] |= DAMAGE_NOW;
+					break;
+				}
+			}
+		}
+	}
+}
+
+// Find the next run of tiles in row with any of the bits in mask set, starting from *tx.
+// Sets [*x0, *x1) to the pixel columns covered and returns 0 when there are no more runs.
+static int nextRun(const FrameBufferDevice *fbd, const uint8_t *row, uint8_t mask, int *tx, int *x0, int *x1) {
+	while((*tx < fbd->tilesX) && !(row[*tx] & mask)) (*tx)++;
+	if(*tx >= fbd->tilesX) return 0;
+	*x0 = *tx * FB_TILE_SIZE;
+	while((*tx < fbd->tilesX) && (row[*tx] & mask)) (*tx)++;
+	*x1 = (*tx * FB_TILE_SIZE < fbd->xres) ? *tx * FB_TILE_SIZE : fbd->xres;
+	return 1;
+}
+
+// Turn the columns [x0, x1) of lines [y0, y1) and convert them into the back page.
+// Quarter turns go a tile at a time: the block is turned into a buffer that stays in cache, and its lines converted from there.
+static size_t pushRotatedSpan(FrameBufferDevice *fbd, int x0, int x1, int y0, int y1) {
+	Pixel block[FB_TILE_SIZE * FB_TILE_SIZE];
+	int bpp = fbd->format.bytesPerPixel;
+	if(fbd->rotation == FB_ROTATE_180) {
+		for(int line = y0; line < y1; line++) {
+			char *l = ((char *)fbd->back) + ((fbd->yres - 1 - line) * fbd->lineLen);
+			for(int x = x0; x < x1; x += FB_TILE_SIZE * FB_TILE_SIZE) {
+				int n = (x1 - x < FB_TILE_SIZE * FB_TILE_SIZE) ? x1 - x : FB_TILE_SIZE * FB_TILE_SIZE;
+				reversePixels(block, fbd->nextFrame + ((size_t)line * fbd->pitch) + x, n);
+				fbd->convert(l + (fbd->xres - x - n) * bpp, block, n, &fbd->format);
+			}
+		}
+		return (size_t)(x1 - x0) * bpp * (y1 - y0);
+	}
+	for(int by = y0; by < y1; by += FB_TILE_SIZE) {
+		int h = (y1 - by < FB_TILE_SIZE) ? y1 - by : FB_TILE_SIZE;
+		for(int bx = x0; bx < x1; bx += FB_TILE_SIZE) {
+			int w = (x1 - bx < FB_TILE_SIZE) ? x1 - bx : FB_TILE_SIZE;
+			rotateBlock(block, fbd->nextFrame + ((size_t)by * fbd->pitch) + bx, fbd->pitch, w, h, fbd->rotation);
+			// Clockwise, frame column x becomes screen line x and frame line y screen column yres - 1 - y.
+			// Anticlockwise, frame column x becomes screen line xres - 1 - x and frame line y screen column y.
+			int top = (fbd->rotation == FB_ROTATE_90) ? bx : fbd->xres - bx - w;
+			int left = (fbd->rotation == FB_ROTATE_90) ? fbd->yres - by - h : by;
+			for(int r = 0; r < w; r++) {
+				fbd->convert(((char *)fbd->back) + ((top + r) * fbd->lineLen) + (left * bpp), block + (r * h), h, &fbd->format);
+			}
+		}
+	}
+	return (size_t)(x1 - x0) * bpp * (y1 - y0);
+}
+
+// Convert the columns [x0, x1) of lines [y0, y1) straight into the back page
+static size_t pushSpan(FrameBufferDevice *fbd, int x0, int x1, int y0, int y1) {
+	if(fbd->rotation) return pushRotatedSpan(fbd, x0, x1, y0, y1);
+	for(int line = y0; line < y1; line++) {
+		char *l = ((char *)fbd->back) + ((line + fbd->outY) * fbd->lineLen) + ((x0 + fbd->outX) * fbd->format.bytesPerPixel);
+		fbd->convert(l, fbd->nextFrame + ((size_t)line * fbd->pitch) + x0, x1 - x0, &fbd->format);
+	}
+	return (size_t)(x1 - x0) * fbd->format.bytesPerPixel * (y1 - y0);
+}
+
+// Write tile rows [ty0, ty1) to the back page: all of them if mask is 0, otherwise runs of tiles with bits in mask.
+// In auto damage mode the rows are diffed first. This is the unit of work shared between swap workers.
+static size_t pushTileRows(FrameBufferDevice *fbd, int ty0, int ty1, uint8_t mask) {
+	size_t written = 0;
+	int x0, x1;
+	if(!mask) return pushSpan(fbd, 0, fbd->xres, ty0 * FB_TILE_SIZE, (ty1 * FB_TILE_SIZE < fbd->yres) ? ty1 * FB_TILE_SIZE : fbd->yres);
+	if(fbd->damageMode == FB_DAMAGE_AUTO) diffTiles(fbd, ty0, ty1);
+	for(int ty = ty0; ty < ty1; ty++) {
+		int y0 = ty * FB_TILE_SIZE;
+		int y1 = (y0 + FB_TILE_SIZE < fbd->yres) ? y0 + FB_TILE_SIZE : fbd->yres;
+		const uint8_t *row = fbd->damaged + (ty * fbd->tilesX);
+		for(int tx = 0; nextRun(fbd, row, mask, &tx, &x0, &x1);) {
+			written += pushSpan(fbd, x0, x1, y0, y1);
+		}
+	}
+	return written;
+}
+
+static int scaled(const FrameBufferDevice *fbd) {
+	if(fbd->rotation) return 0; // Rotated frames are never scaled
+	return (fbd->outW != fbd->xres) || (fbd->outH != fbd->yres);
+}
+
+// Scaled output is made in chunks of this many pixels, small enough to stay in the L1 cache
+#define SCALE_CHUNK 256
+
+// 16.16 fixed point position in a frame of size logical pixels that output pixel o of out samples,
+// lining up pixel centres. Negative for the first output pixels.
+static int64_t samplePos(int o, int size, int out) {
+	return ((int64_t)(2 * o + 1) * size * 65536) / (2 * out) - 32768;
+}
+
+// Upscale the logical columns [x0, x1) and everything they affect into output lines [oy, oy + lines),
+// which all sample logical lines ly0 and ly1 with weight w
+static size_t pushScaledSpan(FrameBufferDevice *fbd, int oy, int lines, int ly0, int ly1, unsigned w, int x0, int x1) {
+	Pixel out[SCALE_CHUNK];
+	Pixel line[SCALE_CHUNK + 3];
+	const Pixel *row0 = fbd->nextFrame + (size_t)ly0 * fbd->pitch;
+	const Pixel *row1 = fbd->nextFrame + (size_t)ly1 * fbd->pitch;
+	int bpp = fbd->format.bytesPerPixel;
+	char *l = ((char *)fbd->back) + ((oy + fbd->outY) * fbd->lineLen) + (fbd->outX * bpp);
+	int k = fbd->outW / fbd->xres;
+	int ox0, ox1;
+	if(fbd->scaleFilter == FB_SCALE_NEAREST) {
+		ox0 = x0 * k;
+		ox1 = x1 * k;
+	} else {
+		// A logical pixel also affects output pixels that sample its neighbours
+		ox0 = ((int64_t)(x0 - 1) * fbd->outW) / fbd->xres;
+		ox1 = ((int64_t)(x1 + 1) * fbd->outW + fbd->xres - 1) / fbd->xres;
+		if(ox0 < 0) ox0 = 0;
+		if(ox1 > fbd->outW) ox1 = fbd->outW;
+	}
+	uint32_t dx = ((int64_t)fbd->xres * 65536) / fbd->outW;
+	// Positions step from output pixel 0 so a span samples the same places whatever column it starts at
+	int64_t origin = samplePos(0, fbd->xres, fbd->outW);
+	for(int ox = ox0; ox < ox1; ox += SCALE_CHUNK) {
+		int n = (ox1 - ox < SCALE_CHUNK) ? ox1 - ox : SCALE_CHUNK;
+		if(fbd->scaleFilter == FB_SCALE_NEAREST) {
+			repeatPixels(out, row0, n, ox, k);
+		} else {
+			int64_t first = origin + ox * (int64_t)dx;
+			int lead = 0;
+			// Output pixels left of the first logical pixel centre just copy it
+			while((lead < n) && (first + lead * (int64_t)dx < 0)) lead++;
+			int sx0 = (lead < n) ? (first + lead * (int64_t)dx) >> 16 : 0;
+			// Logical pixels [sx0, sx1) are sampled, including the right neighbour of the last position
+			int sx1 = ((first + (n - 1) * (int64_t)dx) >> 16) + 2;
+			if(sx1 > fbd->xres) sx1 = fbd->xres;
+			if(sx1 <= sx0) sx1 = sx0 + 1;
+			lerpRows(line, row0 + sx0, row1 + sx0, sx1 - sx0, w);
+			line[sx1 - sx0] = line[sx1 - sx0 - 1]; // The last logical pixel is its own right neighbour
+			for(int i = 0; i < lead; i++) out[i] = line[0];
+			if(lead < n) lerpPixels(out + lead, line, n - lead, first + lead * (int64_t)dx - ((int64_t)sx0 << 16), dx);
+		}
+		for(int line = 0; line < lines; line++) fbd->convert(l + (line * fbd->lineLen) + (ox * bpp), out, n, &fbd->format);
+	}
+	return (size_t)(ox1 - ox0) * bpp * lines;
+}
+
+// Write output lines [oy0, oy1) of a scaled frame: all of them if mask is 0, otherwise those affected by tiles with bits in mask.
+// Damage has to be found before this is called.
+static size_t pushScaledRows(FrameBufferDevice *fbd, int oy0, int oy1, uint8_t mask) {
+	size_t written = 0;
+	for(int oy = oy0, lines; oy < oy1; oy += lines) {
+		int ly0, ly1;
+		unsigned w = 0;
+		lines = 1;
+		if(fbd->scaleFilter == FB_SCALE_NEAREST) {
+			// Lines showing the same logical line are made together
+			int k = fbd->outH / fbd->yres;
+			ly0 = ly1 = oy / k;
+			lines = ((ly0 + 1) * k < oy1) ? (ly0 + 1) * k - oy : oy1 - oy;
+		} else {
+			int64_t y = samplePos(oy, fbd->yres, fbd->outH);
+			if(y < 0) y = 0;
+			ly0 = y >> 16;
+			ly1 = (ly0 + 1 < fbd->yres) ? ly0 + 1 : ly0;
+			w = (y >> 8) & 255;
+		}
+		if(!mask) {
+			written += pushScaledSpan(fbd, oy, lines, ly0, ly1, w, 0, fbd->xres);
+			continue;
+		}
+		// The line changes wherever either logical line it samples does
+		const uint8_t *row0 = fbd->damaged + ((ly0 / FB_TILE_SIZE) * fbd->tilesX);
+		const uint8_t *row1 = fbd->damaged + ((ly1 / FB_TILE_SIZE) * fbd->tilesX);
+		for(int tx = 0; tx < fbd->tilesX;) {
+			if(!((row0[tx] | row1[tx]) & mask)) {
+				tx++;
+				continue;
+			}
+			int x0 = tx * FB_TILE_SIZE;
+			while((tx < fbd->tilesX) && ((row0[tx] | row1[tx]) & mask)) tx++;
+			int x1 = (tx * FB_TILE_SIZE < fbd->xres) ? tx * FB_TILE_SIZE : fbd->xres;
+			written += pushScaledSpan(fbd, oy, lines, ly0, ly1, w, x0, x1);
+		}
+	}
+	return written;
+}
+
+// Worker k of n (the swapping thread is worker 0) handles a band of tile rows, or of output lines when scaling
+static size_t pushBand(FrameBufferDevice *fbd, int k, int n, uint8_t mask) {
+	if(scaled(fbd)) return pushScaledRows(fbd, (fbd->outH * k) / n, (fbd->outH * (k + 1)) / n, mask);
+	return pushTileRows(fbd, (fbd->tilesY * k) / n, (fbd->tilesY * (k + 1)) / n, mask);
+}
+
+// Black out the screen around the frame
+static size_t clearBorder(FrameBufferDevice *fbd) {
+	int bpp = fbd->format.bytesPerPixel;
+	size_t written = 0;
+	for(int line = 0; line < (int)fbd->vinfo.yres; line++) {
+		char *l = ((char *)fbd->back) + (line * fbd->lineLen);
+		if((line < fbd->outY) || (line >= fbd->outY + fbd->outH)) {
+			memset(l, 0, fbd->vinfo.xres * bpp);
+			written += fbd->vinfo.xres * bpp;
+		} else {
+			memset(l, 0, fbd->outX * bpp);
+			memset(l + (fbd->outX + fbd->outW) * bpp, 0, (fbd->vinfo.xres - fbd->outX - fbd->outW) * bpp);
+			written += (fbd->vinfo.xres - fbd->outW) * bpp;
 		}
 	}
-	memcpy(fbd->direct, fbd->swapBuffer, fbd->directSize);
+	return written;
+}
+
+static void *swapWorkerLoop(SwapWorker *w) {
+	FrameBufferDevice *fbd = w->fbd;
+	SwapWorkers *sw = fbd->workers;
+	uint64_t seen = 0;
+	pthread_mutex_lock(&sw->lock);
+	for(;;) {
+		while(sw->running && (sw->generation == seen)) pthread_cond_wait(&sw->start, &sw->lock);
+		if(!sw->running) break;
+		seen = sw->generation;
+		uint8_t mask = sw->mask;
+		pthread_mutex_unlock(&sw->lock);
+		size_t written = pushBand(fbd, w->id, sw->numThreads, mask);
+		streamFence(); // Non-temporal stores are only ordered on this CPU
+		pthread_mutex_lock(&sw->lock);
+		sw->written += written;
+		if(!--sw->remaining) pthread_cond_signal(&sw->finished);
+	}
+	pthread_mutex_unlock(&sw->lock);
+	return NULL;
+}
+
+// Push the whole frame, or its damage, on this thread and any swap workers
+static size_t pushFrame(FrameBufferDevice *fbd, uint8_t mask) {
+	SwapWorkers *sw = fbd->workers;
+	// Bands of output lines need damage from neighbouring tile rows, so find it all first
+	if(mask && scaled(fbd) && (fbd->damageMode == FB_DAMAGE_AUTO)) diffTiles(fbd, 0, fbd->tilesY);
+	if(!sw) {
+		size_t written = pushBand(fbd, 0, 1, mask);
+		streamFence();
+		return written;
+	}
+	pthread_mutex_lock(&sw->lock);
+	sw->mask = mask;
+	sw->written = 0;
+	sw->remaining = sw->numThreads - 1;
+	sw->generation++;
+	pthread_cond_broadcast(&sw->start);
+	pthread_mutex_unlock(&sw->lock);
+	size_t written = pushBand(fbd, 0, sw->numThreads, mask);
+	streamFence();
+	pthread_mutex_lock(&sw->lock);
+	while(sw->remaining) pthread_cond_wait(&sw->finished, &sw->lock);
+	written += sw->written;
+	pthread_mutex_unlock(&sw->lock);
+	return written;
+}
+
+static void waitVsync(FrameBufferDevice *fbd) {
+	uint32_t crtc = 0;
+	if(!(fbd->waitVsync && fbd->vsyncOk)) return;
+	if(ioctl(fbd->fd, FBIO_WAITFORVSYNC, &crtc) == -1) fbd->vsyncOk = 0;
+}
+
+// Show page by panning the display to it, returns non-zero if the driver refused
+static int panTo(FrameBufferDevice *fbd, int page) {
+	fbd->vinfo.yoffset = page * fbd->vinfo.yres;
+	return ioctl(fbd->fd, FBIOPAN_DISPLAY, &fbd->vinfo) == -1;
+}
+
+// Called once the back page has been written
+static void present(FrameBufferDevice *fbd) {
+	if(fbd->presentMode != FB_PRESENT_FLIP) return;
+	if(panTo(fbd, fbd->backPage)) {
+		// Panning stopped working: fall back to copying into the first page
+		perror("swapFBDev");
+		fbd->presentMode = FB_PRESENT_COPY;
+		if(fbd->backPage) {
+			for(int line = 0; line < (int)fbd->vinfo.yres; line++) {
+				memcpy(((char *)fbd->direct) + (line * fbd->lineLen), ((char *)fbd->back) + (line * fbd->lineLen), fbd->vinfo.xres * fbd->format.bytesPerPixel);
+			}
+		}
+		fbd->backPage = 0;
+		fbd->back = fbd->direct;
+		panTo(fbd, 0);
+		return;
+	}
+	waitVsync(fbd);
+	fbd->backPage = !fbd->backPage;
+	fbd->back = ((char *)fbd->direct) + (fbd->backPage * fbd->vinfo.yres * fbd->lineLen);
+}
+
+// The time in nanoseconds if swaps are being timed or traced, so that other swaps never read the clock
+static uint64_t statsClock(const FrameBufferDevice *fbd) {
+	struct timespec ts;
+	if(!fbd->stats && !fbd->latency) return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t clampNs(uint64_t ns) {
+	return (ns > UINT32_MAX) ? UINT32_MAX : ns;
+}
+
+static int bucket(uint32_t ns) {
+	return (ns / FB_STATS_BUCKET_NS < FB_STATS_BUCKETS) ? ns / FB_STATS_BUCKET_NS : FB_STATS_BUCKETS - 1;
+}
+
+static void recordSwap(FrameBufferDevice *fbd, uint64_t start, uint64_t wait, uint64_t push, uint64_t copy, uint64_t end, size_t written) {
+	FrameStats *fs = fbd->stats;
+	SwapStats *s = &fs->stats;
+	pthread_mutex_lock(&fs->lock);
+	SwapTiming *t = &s->recent[fs->next];
+	if(s->numRecent == FB_STATS_HISTORY) {
+		// Forget the oldest swap so the histograms only cover the recent ones
+		if(t->interval) s->intervals[bucket(t->interval)]--;
+		s->totals[bucket(t->total)]--;
+	} else {
+		s->numRecent++;
+	}
+	t->start = start;
+	t->interval = s->swaps ? clampNs(start - fs->lastStart) : 0;
+	t->app = s->swaps ? clampNs(start - fs->lastEnd) : 0;
+	t->wait = clampNs(wait);
+	t->push = clampNs(push);
+	t->copy = clampNs(copy);
+	t->total = clampNs(end - start);
+	t->written = written;
+	if(t->interval) s->intervals[bucket(t->interval)]++;
+	s->totals[bucket(t->total)]++;
+	// An interval of about n frames means n - 1 refreshes showed an old frame
+	if(s->frameNs && (t->interval > s->frameNs + s->frameNs / 2)) s->late += (t->interval + s->frameNs / 2) / s->frameNs - 1;
+	s->swaps++;
+	s->bytes += written;
+	fs->next = (fs->next + 1) % FB_STATS_HISTORY;
+	fs->lastStart = start;
+	fs->lastEnd = end;
+	pthread_mutex_unlock(&fs->lock);
+}
+
+// After a damage mode swap lastFrame is on screen: if sync is set copy the tiles that changed into nextFrame so both match.
+// Then this swap's damage becomes the previous swap's.
+static void syncDamaged(FrameBufferDevice *fbd, int sync) {
+	int x0, x1;
+	for(int ty = 0; ty < fbd->tilesY; ty++) {
+		int y0 = ty * FB_TILE_SIZE;
+		int y1 = (y0 + FB_TILE_SIZE < fbd->yres) ? y0 + FB_TILE_SIZE : fbd->yres;
+		uint8_t *row = fbd->damaged + (ty * fbd->tilesX);
+		for(int tx = 0; sync && nextRun(fbd, row, DAMAGE_NOW, &tx, &x0, &x1);) {
+			for(int line = y0; line < y1; line++) {
+				size_t off = (size_t)line * fbd->pitch + x0;
+				memcpy(fbd->nextFrame + off, fbd->lastFrame + off, (x1 - x0) * sizeof(Pixel));
+			}
+		}
+		for(int tx = 0; tx < fbd->tilesX; tx++) row[tx] = (row[tx] & DAMAGE_NOW) ? DAMAGE_PREV : 0;
+	}
+}
+
+// Present nextFrame and switch it with lastFrame
+static size_t presentFrame(FrameBufferDevice *fbd, int sync) {
+	size_t written;
+	uint8_t mask = 0; // Push everything
+	if(fbd->damageMode != FB_DAMAGE_FULL) {
+		// When flipping the back page is two frames old, so it also misses the previous frame's damage
+		mask = (fbd->presentMode == FB_PRESENT_FLIP) ? DAMAGE_NOW | DAMAGE_PREV : DAMAGE_NOW;
+		if(fbd->fullDamage) memset(fbd->damaged, DAMAGE_NOW, fbd->tilesX * fbd->tilesY);
+	}
+	uint64_t start = statsClock(fbd);
+	if(fbd->presentMode == FB_PRESENT_COPY) waitVsync(fbd);
+	uint64_t pushed = statsClock(fbd);
+	written = pushFrame(fbd, mask);
+	if(fbd->borderPages) {
+		written += clearBorder(fbd);
+		fbd->borderPages--;
+	}
+	uint64_t presented = statsClock(fbd);
+	present(fbd);
+	uint64_t shown = statsClock(fbd);
 	Pixel *tmp = fbd->nextFrame;
 	fbd->nextFrame = fbd->lastFrame;
 	fbd->lastFrame = tmp;
+	if(fbd->capture) captureSwap(fbd, mask ? DAMAGE_NOW : 0);
+	if(fbd->latency) latencySwap(fbd, start, shown);
+	if(mask) syncDamaged(fbd, sync);
+	// Damage isn't tracked in full mode, so a damage mode swap after this has to treat everything as changed
+	else memset(fbd->damaged, DAMAGE_PREV, fbd->tilesX * fbd->tilesY);
+	fbd->fullDamage = 0;
+	if(fbd->stats) {
+		uint64_t end = statsClock(fbd);
+		recordSwap(fbd, start, (pushed - start) + (shown - presented), presented - pushed, end - shown, end, written);
+	}
+	return written;
+}
+
+size_t swapFBDev(FrameBufferDevice *fbd) {
+	assert(fbd);
+	if(fbd->async) return 0; // The present thread is swapping
+	return presentFrame(fbd, 1);
+}
+
+int startSwapWorkersFBDev(FrameBufferDevice *fbd, int numThreads, const int *cpus) {
+	assert(fbd);
+	if(fbd->workers) return 1;
+	if(numThreads < 2) return 0; // The swapping thread is enough
+	SwapWorkers *sw = NULL;
+	TRY(sw = calloc(1, sizeof(SwapWorkers)));
+	TRY(sw->threads = calloc(numThreads, sizeof(SwapWorker)));
+	sw->numThreads = numThreads;
+	sw->running = 1;
+	pthread_mutex_init(&sw->lock, NULL);
+	pthread_cond_init(&sw->start, NULL);
+	pthread_cond_init(&sw->finished, NULL);
+	fbd->workers = sw;
+	// Worker 0 is whichever thread swaps
+	for(int k = 1; k < numThreads; k++) {
+		SwapWorker *w = &sw->threads[k];
+		w->id = k;
+		w->fbd = fbd;
+		if(pthread_create(&w->thread, NULL, (void *(*)(void *)) swapWorkerLoop, w) != 0) {
+			sw->numThreads = k; // Only join the workers that were started
+			stopSwapWorkersFBDev(fbd);
+			sw = NULL;
+			goto fail;
+		}
+		if(cpus) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[k - 1], &set);
+			if(pthread_setaffinity_np(w->thread, sizeof(set), &set) != 0) perror("startSwapWorkersFBDev");
+		}
+	}
+	return 0;
+fail:
+	perror("startSwapWorkersFBDev");
+	if(sw) free(sw->threads);
+	free(sw);
+	return -1;
+}
+
+void stopSwapWorkersFBDev(FrameBufferDevice *fbd) {
+	assert(fbd);
+	SwapWorkers *sw = fbd->workers;
+	if(!sw) return;
+	pthread_mutex_lock(&sw->lock);
+	sw->running = 0;
+	pthread_cond_broadcast(&sw->start);
+	pthread_mutex_unlock(&sw->lock);
+	for(int k = 1; k < sw->numThreads; k++) pthread_join(sw->threads[k].thread, NULL);
+	fbd->workers = NULL;
+	pthread_mutex_destroy(&sw->lock);
+	pthread_cond_destroy(&sw->start);
+	pthread_cond_destroy(&sw->finished);
+	free(sw->threads);
+	free(sw);
+}
+
+static void *presentLoop(FrameBufferDevice *fbd) {
+	PresentQueue *q = fbd->async;
+	size_t tiles = fbd->tilesX * fbd->tilesY;
+	pthread_mutex_lock(&q->lock);
+	for(;;) {
+		while((q->pending == -1) && q->running) pthread_cond_wait(&q->wake, &q->lock);
+		if(q->pending == -1) break; // Stopped with nothing left to present
+		int frame = q->pending;
+		uint64_t seq = q->pendingSeq;
+		q->pending = -1;
+		q->state[frame] = FRAME_BUSY;
+		for(size_t t = 0; t < tiles; t++) fbd->damaged[t] |= q->submitted[t];
+		memset(q->submitted, 0, tiles);
+		if(fbd->latency) latencyTake(fbd);
+		pthread_mutex_unlock(&q->lock);
+
+		fbd->nextFrame = q->frames[frame];
+		presentFrame(fbd, 0);
+		if(fbd->presented) fbd->presented(fbd, seq, fbd->presentedData);
+
+		pthread_mutex_lock(&q->lock);
+		q->state[q->shown] = FRAME_FREE;
+		q->shown = frame;
+		q->presentedSeq = seq;
+		pthread_cond_broadcast(&q->done);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+static void freePresentQueue(PresentQueue *q) {
+	for(int f = 0; f < q->numFrames; f++) free(q->frames[f]);
+	free(q->frames);
+	free(q->state);
+	free(q->marked);
+	free(q->submitted);
+	free(q);
+}
+
+int startPresentFBDev(FrameBufferDevice *fbd, int numFrames) {
+	assert(fbd);
+	if(fbd->async) return 1;
+	PresentQueue *q = NULL;
+	size_t tiles = fbd->tilesX * fbd->tilesY;
+	if(numFrames < 3) numFrames = 3;
+	// The queue swaps frames in and out, which spanning heads' shared ones can't be
+	errno = EINVAL;
+	TRY(!fbd->spanned);
+	TRY(q = calloc(1, sizeof(PresentQueue)));
+	q->numFrames = numFrames;
+	q->pending = -1;
+	q->running = 1;
+	TRY(q->frames = calloc(numFrames, sizeof(Pixel *)));
+	TRY(q->state = calloc(numFrames, sizeof(int)));
+	TRY(q->marked = calloc(tiles, 1));
+	TRY(q->submitted = calloc(tiles, 1));
+	// lastFrame is on screen and nextFrame is free: the rest of the frames are new
+	for(int f = 2; f < numFrames; f++) TRY(q->frames[f] = allocFrame(fbd->frameSize));
+	q->frames[0] = fbd->lastFrame;
+	q->frames[1] = fbd->nextFrame;
+	q->state[0] = FRAME_BUSY;
+	q->shown = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->wake, NULL);
+	pthread_cond_init(&q->done, NULL);
+	fbd->async = q;
+	if(pthread_create(&q->thread, NULL, (void *(*)(void *)) presentLoop, fbd) != 0) {
+		fbd->async = NULL;
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->wake);
+		pthread_cond_destroy(&q->done);
+		goto fail;
+	}
+	return 0;
+fail:
+	perror("startPresentFBDev");
+	if(q) {
+		// Don't free the frames that still belong to fbd
+		if(q->frames) q->frames[0] = q->frames[1] = NULL;
+		freePresentQueue(q);
+	}
+	return -1;
+}
+
+void stopPresentFBDev(FrameBufferDevice *fbd) {
+	assert(fbd);
+	PresentQueue *q = fbd->async;
+	if(!q) return;
+	pthread_mutex_lock(&q->lock);
+	q->running = 0;
+	pthread_cond_signal(&q->wake);
+	pthread_cond_broadcast(&q->done);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->thread, NULL);
+	fbd->async = NULL;
+	if(fbd->stats) fbd->stats->stats.dropped += q->dropped; // Keep counting across restarts
+	// Keep the frame on screen as lastFrame and any other as nextFrame
+	fbd->lastFrame = q->frames[q->shown];
+	fbd->nextFrame = q->frames[(q->shown + 1) % q->numFrames];
+	q->frames[q->shown] = NULL;
+	q->frames[(q->shown + 1) % q->numFrames] = NULL;
+	// Marks that never made it to a presented frame still apply to the next swap
+	size_t tiles = fbd->tilesX * fbd->tilesY;
+	for(size_t t = 0; t < tiles; t++) fbd->damaged[t] |= q->marked[t] | q->submitted[t];
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->wake);
+	pthread_cond_destroy(&q->done);
+	freePresentQueue(q);
+}
+
+Pixel *acquireFrameFBDev(FrameBufferDevice *fbd) {
+	assert(fbd);
+	PresentQueue *q = fbd->async;
+	if(!q) return NULL;
+	Pixel *frame = NULL;
+	pthread_mutex_lock(&q->lock);
+	while(q->running && !frame) {
+		for(int f = 0; f < q->numFrames; f++) {
+			if(q->state[f] == FRAME_FREE) {
+				q->state[f] = FRAME_ACQUIRED;
+				frame = q->frames[f];
+				break;
+			}
+		}
+		if(!frame) pthread_cond_wait(&q->done, &q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return frame;
+}
+
+uint64_t submitFrameFBDev(FrameBufferDevice *fbd, Pixel *frame) {
+	assert(fbd);
+	PresentQueue *q = fbd->async;
+	if(!q) return 0;
+	uint64_t seq = 0;
+	size_t tiles = fbd->tilesX * fbd->tilesY;
+	pthread_mutex_lock(&q->lock);
+	for(int f = 0; f < q->numFrames; f++) {
+		if((q->frames[f] != frame) || (q->state[f] != FRAME_ACQUIRED)) continue;
+		// The newest frame wins: an older frame that hasn't been presented yet is dropped
+		if(q->pending != -1) {
+			q->state[q->pending] = FRAME_FREE;
+			q->dropped++;
+			pthread_cond_broadcast(&q->done);
+		}
+		q->pending = f;
+		q->state[f] = FRAME_PENDING;
+		seq = q->pendingSeq = ++q->submittedSeq;
+		for(size_t t = 0; t < tiles; t++) q->submitted[t] |= q->marked[t];
+		memset(q->marked, 0, tiles);
+		if(fbd->latency) latencySubmit(fbd);
+		pthread_cond_signal(&q->wake);
+		break;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return seq;
+}
+
+void waitFrameFBDev(FrameBufferDevice *fbd, uint64_t seq) {
+	assert(fbd);
+	PresentQueue *q = fbd->async;
+	if(!q) return;
+	pthread_mutex_lock(&q->lock);
+	while(q->running && (q->presentedSeq < seq)) pthread_cond_wait(&q->done, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
+
+uint64_t droppedFramesFBDev(FrameBufferDevice *fbd) {
+	assert(fbd);
+	PresentQueue *q = fbd->async;
+	if(!q) return 0;
+	pthread_mutex_lock(&q->lock);
+	uint64_t dropped = q->dropped;
+	pthread_mutex_unlock(&q->lock);
+	return dropped;
+}
+
+// Refresh interval of the video mode in nanoseconds, 0 if the driver doesn't say
+static uint32_t refreshNs(const struct fb_var_screeninfo *vinfo) {
+	uint64_t htotal = vinfo->xres + vinfo->left_margin + vinfo->right_margin + vinfo->hsync_len;
+	uint64_t vtotal = vinfo->yres + vinfo->upper_margin + vinfo->lower_margin + vinfo->vsync_len;
+	return clampNs((vinfo->pixclock * htotal * vtotal) / 1000); // pixclock is in picoseconds
+}
+
+int startStatsFBDev(FrameBufferDevice *fbd, uint32_t frameNs) {
+	assert(fbd);
+	if(fbd->stats) return 1;
+	FrameStats *fs;
+	TRY(fs = calloc(1, sizeof(FrameStats)));
+	pthread_mutex_init(&fs->lock, NULL);
+	fs->stats.frameNs = frameNs ? frameNs : refreshNs(&fbd->vinfo);
+	fbd->stats = fs;
+	return 0;
+fail:
+	perror("startStatsFBDev");
+	return -1;
+}
+
+void stopStatsFBDev(FrameBufferDevice *fbd) {
+	assert(fbd);
+	FrameStats *fs = fbd->stats;
+	if(!fs) return;
+	fbd->stats = NULL;
+	pthread_mutex_destroy(&fs->lock);
+	free(fs);
+}
+
+int getStatsFBDev(FrameBufferDevice *fbd, SwapStats *stats) {
+	assert(fbd && stats);
+	FrameStats *fs = fbd->stats;
+	if(!fs) return 1;
+	pthread_mutex_lock(&fs->lock);
+	*stats = fs->stats;
+	stats->dropped += droppedFramesFBDev(fbd);
+	// Unroll the ring so the oldest swap comes first
+	int oldest = (fs->stats.numRecent == FB_STATS_HISTORY) ? fs->next : 0;
+	for(int i = 0; i < fs->stats.numRecent; i++) stats->recent[i] = fs->stats.recent[(oldest + i) % FB_STATS_HISTORY];
+	pthread_mutex_unlock(&fs->lock);
+	return 0;
+}
+
+uint64_t percentileFBDev(const uint32_t *histogram, double p) {
+	uint64_t count = 0, seen = 0;
+	for(int b = 0; b < FB_STATS_BUCKETS; b++) count += histogram[b];
+	for(int b = 0; b < FB_STATS_BUCKETS; b++) {
+		seen += histogram[b];
+		if(histogram[b] && (seen >= p * count)) return (uint64_t)(b + 1) * FB_STATS_BUCKET_NS;
+	}
+	return 0;
+}
+
+void dumpStatsFBDev(FrameBufferDevice *fbd, FILE *f) {
+	assert(fbd && f);
+	SwapStats *s;
+	if(!(s = malloc(sizeof(SwapStats))) || getStatsFBDev(fbd, s)) {
+		free(s);
+		return;
+	}
+	uint64_t app = 0, wait = 0, push = 0, copy = 0, written = 0;
+	for(int i = 0; i < s->numRecent; i++) {
+		app += s->recent[i].app;
+		wait += s->recent[i].wait;
+		push += s->recent[i].push;
+		copy += s->recent[i].copy;
+		written += s->recent[i].written;
+	}
+	int n = s->numRecent ? s->numRecent : 1;
+	fprintf(f, "%llu swaps, %llu bytes written, %llu late, %llu dropped\n",
+		(unsigned long long)s->swaps, (unsigned long long)s->bytes, (unsigned long long)s->late, (unsigned long long)s->dropped);
+	fprintf(f, "last %d swaps: mean app %.3f ms, wait %.3f ms, push %.3f ms, copy %.3f ms, %llu bytes\n", s->numRecent,
+		app / 1e6 / n, wait / 1e6 / n, push / 1e6 / n, copy / 1e6 / n, (unsigned long long)(written / n));
+	fprintf(f, "interval p50 %.1f ms, p99 %.1f ms; swap p50 %.1f ms, p99 %.1f ms\n",
+		percentileFBDev(s->intervals, 0.5) / 1e6, percentileFBDev(s->intervals, 0.99) / 1e6,
+		percentileFBDev(s->totals, 0.5) / 1e6, percentileFBDev(s->totals, 0.99) / 1e6);
+	free(s);
 }
 
 void debugFB(const struct fb_var_screeninfo vinfo, const struct fb_fix_screeninfo finfo) {
@@ -109,18 +934,9 @@ void debugFB(const struct fb_var_screeninfo vinfo, const struct fb_fix_screeninf
 	printf("\n");
 }
 
-uint32_t formatPxARGB(Pixel px) {
-	uint32_t out = 0;
-	out |= ((uint32_t)px.r) << 16;
-	out |= ((uint32_t)px.g) << 8;
-	out |= ((uint32_t)px.b);
-	out |= ((uint32_t)px.a) << 24;
-	return out;
-}
-
-FrameBufferDevice *openFBDev(const char *path) {
-	FrameBufferDevice *fbd = NULL;
-	TRY(fbd = malloc(sizeof(FrameBufferDevice)));
+static FrameBufferDevice *newFBDev(void) {
+	FrameBufferDevice *fbd = malloc(sizeof(FrameBufferDevice));
+	if(!fbd) return NULL;
 	*fbd = (FrameBufferDevice) {
 		.nextFrame = NULL,
 		.lastFrame = NULL,
@@ -128,9 +944,53 @@ FrameBufferDevice *openFBDev(const char *path) {
 		.fd = -1,
 		.close = closeFBDev,
 		.swap = swapFBDev,
+		.damage = damageFBDev,
 		.modeset = 0,
-		.formatPx = formatPxARGB, //TODO: Detect proper pixel placement from vinfo, my screen is using ARGB, so that's what's implemented
+		.damageMode = FB_DAMAGE_FULL,
+		.damaged = NULL,
+		.fullDamage = 1,
+		.presentMode = FB_PRESENT_COPY,
+		.scaleFilter = FB_SCALE_NEAREST,
+		.waitVsync = 1,
+		.vsyncOk = 1,
 	};
+	return fbd;
+}
+
+// Set up frames and map fbd->fd once the mode is known, returns non-zero and sets errno on failure
+static int setupFBDev(FrameBufferDevice *fbd, const struct fb_var_screeninfo *vinfo, size_t directSize, size_t lineLen, int prot) {
+	fbd->vinfo = *vinfo;
+	if(detectPixelFormat(&fbd->format, vinfo)) {
+		errno = ENOTSUP;
+		return 1;
+	}
+	fbd->convert = selectConverter(&fbd->format, 1);
+	fbd->xres = fbd->pitch = fbd->outW = vinfo->xres;
+	fbd->yres = fbd->outH = vinfo->yres;
+	fbd->numPixels = fbd->xres * fbd->yres;
+	fbd->frameSize = fbd->numPixels * sizeof(Pixel);
+	fbd->directSize = directSize;
+	fbd->lineLen = lineLen;
+	// Visible lines are written straight into the mapping, so they must fit
+	if(((size_t)fbd->xres * fbd->format.bytesPerPixel > fbd->lineLen) || ((size_t)fbd->yres * fbd->lineLen > fbd->directSize)) {
+		errno = EINVAL;
+		return 1;
+	}
+	TRY(fbd->nextFrame = allocFrame(fbd->frameSize));
+	TRY(fbd->lastFrame = allocFrame(fbd->frameSize));
+	fbd->tilesX = (fbd->xres + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+	fbd->tilesY = (fbd->yres + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+	TRY(fbd->damaged = calloc(fbd->tilesX * fbd->tilesY, 1));
+	TRY((fbd->direct = mmap(NULL, fbd->directSize, prot, MAP_SHARED, fbd->fd, 0)) != MAP_FAILED);
+	fbd->back = fbd->direct;
+	return 0;
+fail:
+	return 1;
+}
+
+FrameBufferDevice *openFBDev(const char *path) {
+	FrameBufferDevice *fbd = NULL;
+	TRY(fbd = newFBDev());
 	TRY((fbd->modeset = (!setGraphics())) == 1);
 	TRY((fbd->fd = open(path, O_RDWR)) != -1);
 	struct fb_var_screeninfo vinfo;
@@ -138,19 +998,137 @@ FrameBufferDevice *openFBDev(const char *path) {
 	TRY(ioctl(fbd->fd, FBIOGET_VSCREENINFO, &vinfo) == 0);
 	TRY(ioctl(fbd->fd, FBIOGET_FSCREENINFO, &finfo) == 0);
 //	debugFB(vinfo, finfo);
-	fbd->xres = vinfo.xres;
-	fbd->yres = vinfo.yres;
-	fbd->numPixels = fbd->xres * fbd->yres;
-	fbd->frameSize = fbd->numPixels * sizeof(Pixel);
-	fbd->directSize = finfo.smem_len;
-	fbd->lineLen = finfo.line_length;
-	TRY(fbd->nextFrame = calloc(1, fbd->frameSize));
-	TRY(fbd->lastFrame = calloc(1, fbd->frameSize));
-	TRY(fbd->swapBuffer = malloc(fbd->directSize));
-	TRY((fbd->direct = mmap(NULL, fbd->directSize, PROT_WRITE, MAP_SHARED, fbd->fd, 0)) != MAP_FAILED);
+	if((finfo.visual != FB_VISUAL_TRUECOLOR) && (finfo.visual != FB_VISUAL_DIRECTCOLOR)) {
+		errno = ENOTSUP;
+		goto fail;
+	}
+	TRY(!setupFBDev(fbd, &vinfo, finfo.smem_len, finfo.line_length, PROT_WRITE));
+	// Flip between two pages if the virtual screen has room and the driver lets us pan to the first one
+	if((vinfo.yres_virtual >= 2 * vinfo.yres) && (2 * vinfo.yres * fbd->lineLen <= fbd->directSize)
+			&& finfo.ypanstep && !(vinfo.yres % finfo.ypanstep) && !panTo(fbd, 0)) {
+		fbd->presentMode = FB_PRESENT_FLIP;
+		fbd->backPage = 1;
+		fbd->back = ((char *)fbd->direct) + (vinfo.yres * fbd->lineLen);
+	}
 	return fbd;
 fail:
 	perror("openFBDev");
 	if(fbd) fbd->close(fbd);
 	return NULL;
 }
+
+// Replace the frames with xres by yres ones, returns non-zero on failure
+static int resizeFrames(FrameBufferDevice *fbd, int xres, int yres) {
+	Pixel *nextFrame = NULL, *lastFrame = NULL;
+	uint8_t *damaged = NULL;
+	size_t frameSize = (size_t)xres * yres * sizeof(Pixel);
+	int tilesX = (xres + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+	int tilesY = (yres + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+	TRY(nextFrame = allocFrame(frameSize));
+	TRY(lastFrame = allocFrame(frameSize));
+	TRY(damaged = calloc(tilesX * tilesY, 1));
+	free(fbd->nextFrame);
+	free(fbd->lastFrame);
+	free(fbd->damaged);
+	fbd->nextFrame = nextFrame;
+	fbd->lastFrame = lastFrame;
+	fbd->damaged = damaged;
+	fbd->xres = fbd->pitch = xres;
+	fbd->yres = yres;
+	fbd->numPixels = (size_t)xres * yres;
+	fbd->frameSize = frameSize;
+	fbd->tilesX = tilesX;
+	fbd->tilesY = tilesY;
+	fbd->fullDamage = 1;
+	return 0;
+fail:
+	free(nextFrame);
+	free(lastFrame);
+	free(damaged);
+	return 1;
+}
+
+int scaleFBDev(FrameBufferDevice *fbd, int xres, int yres, int filter) {
+	assert(fbd);
+	int screenW = fbd->vinfo.xres, screenH = fbd->vinfo.yres;
+	errno = EINVAL;
+	TRY(!fbd->async && !fbd->capture && !fbd->spanned && !fbd->rotation && (xres > 0) && (yres > 0) && (xres <= screenW) && (yres <= screenH));
+	TRY((filter == FB_SCALE_NEAREST) || (filter == FB_SCALE_BILINEAR));
+	TRY(!resizeFrames(fbd, xres, yres));
+	fbd->scaleFilter = filter;
+	if(filter == FB_SCALE_NEAREST) {
+		int k = (screenW / xres < screenH / yres) ? screenW / xres : screenH / yres;
+		fbd->outW = xres * k;
+		fbd->outH = yres * k;
+	} else if((int64_t)screenW * yres <= (int64_t)screenH * xres) {
+		fbd->outW = screenW;
+		fbd->outH = ((int64_t)screenW * yres) / xres;
+	} else {
+		fbd->outW = ((int64_t)screenH * xres) / yres;
+		fbd->outH = screenH;
+	}
+	fbd->outX = (screenW - fbd->outW) / 2;
+	fbd->outY = (screenH - fbd->outH) / 2;
+	// Both pages need their borders cleared when flipping
+	fbd->borderPages = 2;
+	return 0;
+fail:
+	perror("scaleFBDev");
+	return -1;
+}
+
+int rotateFBDev(FrameBufferDevice *fbd, int rotation) {
+	assert(fbd);
+	int screenW = fbd->vinfo.xres, screenH = fbd->vinfo.yres;
+	errno = EINVAL;
+	TRY(!fbd->async && !fbd->capture && !fbd->spanned && (rotation >= FB_ROTATE_0) && (rotation <= FB_ROTATE_270));
+	// A quarter turn switches the frame's width and height
+	TRY(!resizeFrames(fbd, (rotation & 1) ? screenH : screenW, (rotation & 1) ? screenW : screenH));
+	fbd->rotation = rotation;
+	fbd->outX = fbd->outY = 0;
+	fbd->outW = screenW;
+	fbd->outH = screenH;
+	fbd->borderPages = 0;
+	return 0;
+fail:
+	perror("rotateFBDev");
+	return -1;
+}
+
+FrameBufferDevice *openHeadlessFBDev(const char *path, int xres, int yres, size_t lineLen, const PixelFormat *format) {
+	static const PixelFormat argb = {
+		.bytesPerPixel = 4,
+		.offset = {16, 8, 0, 24},
+		.length = {8, 8, 8, 8},
+	};
+	FrameBufferDevice *fbd = NULL;
+	if(!format) format = &argb;
+	if(!lineLen) lineLen = (size_t)xres * format->bytesPerPixel;
+	// Describe the memory as a screen so that it is set up like one
+	struct fb_var_screeninfo vinfo = {
+		.xres = xres,
+		.yres = yres,
+		.xres_virtual = xres,
+		.yres_virtual = yres,
+		.bits_per_pixel = 8 * format->bytesPerPixel,
+		.red = {format->offset[0], format->length[0], 0},
+		.green = {format->offset[1], format->length[1], 0},
+		.blue = {format->offset[2], format->length[2], 0},
+		.transp = {format->offset[3], format->length[3], 0},
+	};
+	TRY(fbd = newFBDev());
+	fbd->waitVsync = 0;
+	fbd->vsyncOk = 0;
+	if(path) {
+		TRY((fbd->fd = open(path, O_RDWR | O_CREAT, 0644)) != -1);
+	} else {
+		TRY((fbd->fd = memfd_create("headless-fb", MFD_CLOEXEC)) != -1);
+	}
+	TRY(ftruncate(fbd->fd, lineLen * yres) == 0);
+	TRY(!setupFBDev(fbd, &vinfo, lineLen * yres, lineLen, PROT_READ | PROT_WRITE));
+	return fbd;
+fail:
+	perror("openHeadlessFBDev");
+	if(fbd) fbd->close(fbd);
+	return NULL;
+}
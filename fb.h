@@ -20,28 +20,181 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <linux/fb.h>
+#include <pthread.h>
+#include <stdio.h>
 
 typedef struct pixel {
 	uint8_t r, g, b, a;
 } Pixel;
 
+// Damage tracking is done in square tiles of this many pixels
+#define FB_TILE_SIZE 32
+
+// Damage modes: full pushes the whole frame on every swap,
+// manual pushes only rectangles marked with damage,
+// auto also compares nextFrame with lastFrame to find changed tiles
+#define FB_DAMAGE_FULL 0
+#define FB_DAMAGE_MANUAL 1
+#define FB_DAMAGE_AUTO 2
+
+// Presentation modes: copy writes every frame into the visible page,
+// flip writes into a hidden page and pans the display to it
+#define FB_PRESENT_COPY 0
+#define FB_PRESENT_FLIP 1
+
+// Scaling filters: nearest scales by a whole number, bilinear fills the screen keeping the aspect ratio
+#define FB_SCALE_NEAREST 0
+#define FB_SCALE_BILINEAR 1
+
+// Rotations, in quarter turns clockwise from the screen's orientation to the frame's
+#define FB_ROTATE_0 0
+#define FB_ROTATE_90 1
+#define FB_ROTATE_180 2
+#define FB_ROTATE_270 3
+
+// Layout of a pixel in the framebuffer
+typedef struct pixelFormat {
+	int bytesPerPixel;
+	uint8_t offset[4]; // Bit offsets of r, g, b and a
+	uint8_t length[4]; // Bit lengths of r, g, b and a, 0 if the channel is absent
+	const char *kernel; // Name of the conversion kernel in use
+} PixelFormat;
+
+// Converts n pixels from src into the framebuffer format at dst
+typedef void (*PixelConverter)(void *dst, const Pixel *src, size_t n, const PixelFormat *fmt);
+
+// State of asynchronous presentation, swap worker threads and swap timing, private to fb.c
+typedef struct presentQueue PresentQueue;
+typedef struct swapWorkers SwapWorkers;
+typedef struct frameStats FrameStats;
+// State of frame capture, private to capture.c
+typedef struct frameCapture FrameCapture;
+// State of latency tracing, private to latency.c
+typedef struct latencyTrace LatencyTrace;
+
+// Swap timing keeps this many recent swaps, and histograms of them
+#define FB_STATS_HISTORY 128
+// Histogram bucket b counts times in [b, b + 1) * FB_STATS_BUCKET_NS, the last bucket counts anything longer
+#define FB_STATS_BUCKETS 64
+#define FB_STATS_BUCKET_NS 500000
+
+// Where the time of one swap went, in nanoseconds
+typedef struct swapTiming {
+	uint64_t start; // CLOCK_MONOTONIC time the swap started
+	uint32_t interval; // Since the previous swap started, 0 for the first one
+	uint32_t app; // Between the end of the previous swap and the start of this one
+	uint32_t wait; // Waiting for vertical blanking and panning
+	uint32_t push; // Finding damage, converting and writing to the framebuffer
+	uint32_t copy; // Bringing the new nextFrame up to date
+	uint32_t total; // The whole swap
+	size_t written; // Bytes written to the framebuffer
+} SwapTiming;
+
+typedef struct swapStats {
+	uint64_t swaps; // Since timing started
+	uint64_t bytes;
+	uint64_t late; // Refreshes missed because the interval between swaps was longer than frameNs
+	uint64_t dropped; // Frames replaced before they were presented (see submitFrameFBDev)
+	uint32_t frameNs; // Expected interval between swaps, 0 if unknown
+	int numRecent;
+	SwapTiming recent[FB_STATS_HISTORY]; // The last numRecent swaps, oldest first
+	uint32_t intervals[FB_STATS_BUCKETS]; // Histogram of interval over the recent swaps
+	uint32_t totals[FB_STATS_BUCKETS]; // Histogram of total over the recent swaps
+} SwapStats;
+
 typedef struct frameBufferDevice {
 	int xres, yres;
 	size_t numPixels;
 	size_t frameSize;
 	Pixel *nextFrame;
 	Pixel *lastFrame;
+	size_t pitch; // Pixels from one line of nextFrame or lastFrame to the next, normally xres
+	int spanned; // Set when nextFrame and lastFrame belong to a spanning MultiHead, so they are never reallocated or freed
 	size_t directSize;
 	size_t lineLen;
 	void *direct;
-	void *swapBuffer;
+	void *back; // The page swap writes into: the start of direct unless flipping
+	int backPage;
+	int presentMode;
+	int waitVsync; // Wait for vertical blanking on each swap: cleared vsyncOk means the driver can't
+	int vsyncOk;
+	struct fb_var_screeninfo vinfo;
 	int fd;
 	int modeset;
+	int rotation;
+	int scaleFilter;
+	int outX, outY, outW, outH; // Where frames are shown on the screen, in screen pixels
+	int borderPages; // Pages whose letterbox border still has to be cleared
+	int damageMode;
+	int tilesX, tilesY;
+	uint8_t *damaged; // One flag per tile, row-major
+	int fullDamage; // Set when the screen contents are unknown: the next swap pushes everything
 	void (*close)(struct frameBufferDevice *fbd);
-	void (*swap)(struct frameBufferDevice *fbd);
-	uint32_t (*formatPx)(Pixel px);
+	size_t (*swap)(struct frameBufferDevice *fbd); // Returns the number of bytes written to the framebuffer
+	void (*damage)(struct frameBufferDevice *fbd, int x, int y, int w, int h);
+	SwapWorkers *workers; // NULL unless swapping on several threads
+	PresentQueue *async; // NULL unless presenting asynchronously
+	FrameStats *stats; // NULL unless timing swaps
+	FrameCapture *capture; // NULL unless capturing swaps, see capture.h
+	LatencyTrace *latency; // NULL unless tracing input latency, see latency.h
+	void (*presented)(struct frameBufferDevice *fbd, uint64_t seq, void *data); // Called from the present thread, may be NULL
+	void *presentedData;
+	PixelFormat format;
+	PixelConverter convert;
 } FrameBufferDevice;
 
 FrameBufferDevice *openFBDev(const char *path);
+// A framebuffer in memory, for testing and benchmarking without a screen or a tty.
+// Frames go to the file at path, or to anonymous memory if path is NULL.
+// lineLen is the number of bytes between lines (0 packs them) and format the pixel layout (NULL for ARGB8888).
+FrameBufferDevice *openHeadlessFBDev(const char *path, int xres, int yres, size_t lineLen, const PixelFormat *format);
+
+// Render at xres by yres (no larger than the screen) and have swap upscale frames with filter, centred with black borders.
+// Frames can't be both scaled and rotated.
+// The frames are reallocated, so surfaces and compositors made for the old ones are invalid.
+// Not allowed while presenting asynchronously or capturing. Returns 0 on success, -1 on failure.
+int scaleFBDev(FrameBufferDevice *fbd, int xres, int yres, int filter);
+// Turn frames by rotation as swap writes them, for screens mounted on their side or upside down.
+// Frames are reallocated at the screen's size, with xres and yres switched for quarter turns, and scaling is turned off.
+// Not allowed while presenting asynchronously or capturing. Returns 0 on success, -1 on failure.
+int rotateFBDev(FrameBufferDevice *fbd, int rotation);
+
+// Split each swap into bands of scanlines converted on numThreads threads, including the one that swaps.
+// The other numThreads - 1 threads persist until stopped: if cpus isn't NULL worker k is pinned to cpus[k - 1].
+// Returns 0 on success (including when numThreads < 2, which does nothing), 1 if already started, -1 on failure.
+int startSwapWorkersFBDev(FrameBufferDevice *fbd, int numThreads, const int *cpus);
+void stopSwapWorkersFBDev(FrameBufferDevice *fbd); // Called by close
+
+// Asynchronous presentation: a thread owned by fbd swaps submitted frames while the application draws the next one.
+// numFrames buffers are used (at least 3): one on screen, one waiting to be presented and the rest for drawing.
+// Returns 0 on success, 1 if already started, -1 on failure.
+// Don't call swap while presenting asynchronously.
+int startPresentFBDev(FrameBufferDevice *fbd, int numFrames);
+void stopPresentFBDev(FrameBufferDevice *fbd); // Presents the last submitted frame first, called by close
+
+// Get a frame to draw into, blocking until one is free. Frames hold old contents, so redraw all of them.
+// Returns NULL if not presenting asynchronously.
+Pixel *acquireFrameFBDev(FrameBufferDevice *fbd);
+// Queue an acquired frame for presentation without blocking, replacing any frame that hasn't been presented yet.
+// Returns the frame's sequence number (counting from 1), or 0 if frame wasn't acquired.
+uint64_t submitFrameFBDev(FrameBufferDevice *fbd, Pixel *frame);
+// Block until frame seq, or a newer frame that replaced it, has been presented
+void waitFrameFBDev(FrameBufferDevice *fbd, uint64_t seq);
+// Number of submitted frames replaced before they were presented
+uint64_t droppedFramesFBDev(FrameBufferDevice *fbd);
+
+// Time every swap: when not started swap doesn't read the clock.
+// frameNs is the expected interval between swaps used to count late frames, or 0 to use the screen's refresh rate.
+// Start and stop timing while not presenting asynchronously.
+// Returns 0 on success, 1 if already started, -1 on failure.
+int startStatsFBDev(FrameBufferDevice *fbd, uint32_t frameNs);
+void stopStatsFBDev(FrameBufferDevice *fbd); // Called by close
+// Copy the current statistics into stats, returns non-zero if timing hasn't been started
+int getStatsFBDev(FrameBufferDevice *fbd, SwapStats *stats);
+// Nanoseconds below which fraction p (0 to 1) of the times counted by histogram fall
+uint64_t percentileFBDev(const uint32_t *histogram, double p);
+// Write a summary of the statistics to f
+void dumpStatsFBDev(FrameBufferDevice *fbd, FILE *f);
 
 #endif /* FB_H */
@@ -0,0 +1,147 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures swap throughput and latency on a headless framebuffer.
+// Prints one JSON object per line for each combination of pixel format, conversion kernel, thread count and workload.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fb.h"
+#include "convert.h"
+#include "draw.h"
+
+typedef struct format {
+	const char *name;
+	PixelFormat format;
+} Format;
+
+static const Format formats[] = {
+	{"argb8888", {4, {16, 8, 0, 24}, {8, 8, 8, 8}, NULL}},
+	{"rgb565", {2, {11, 5, 0, 0}, {5, 6, 5, 0}, NULL}},
+	{"rgb888", {3, {16, 8, 0, 0}, {8, 8, 8, 0}, NULL}},
+};
+
+static const char *kernels[] = {"avx2-nt", "avx2", "sse2-nt", "sse2", "ssse3", "neon", "scalar", "generic"};
+
+// Workloads: what changes between frames, and how swap finds out
+#define WL_FULL 0 // Everything is redrawn and written
+#define WL_SPARSE 1 // A cursor and a status line, marked as damage
+#define WL_AUTO 2 // The same, found by comparing frames
+#define WL_WORST 3 // One pixel at the end of every tile, found by comparing frames
+static const char *workloads[] = {"full", "sparse", "auto-sparse", "worst"};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void drawFrame(FrameBufferDevice *fbd, int workload, int frame) {
+	Pixel colour = {frame * 7, frame * 13, frame * 17, 255};
+	Surface s = frameSurface(fbd, fbd->nextFrame);
+	if(workload != WL_SPARSE) s.damage = NULL;
+	switch(workload) {
+	case WL_FULL:
+		fillRect(&s, 0, 0, fbd->xres, fbd->yres, colour);
+		break;
+	case WL_SPARSE:
+	case WL_AUTO:
+		fillRect(&s, (frame * 37) % fbd->xres, (frame * 23) % fbd->yres, 32, 32, colour);
+		fillRect(&s, 0, fbd->yres - 16, fbd->xres, 16, colour);
+		break;
+	case WL_WORST:
+		for(int y = FB_TILE_SIZE - 1; y < fbd->yres; y += FB_TILE_SIZE) {
+			for(int x = FB_TILE_SIZE - 1; x < fbd->xres; x += FB_TILE_SIZE) fbd->nextFrame[(size_t)y * fbd->xres + x] = colour;
+		}
+		break;
+	}
+}
+
+static void run(const Format *f, const char *kernel, int threads, int workload, int xres, int yres, int frames) {
+	PixelFormat format = f->format;
+	FrameBufferDevice *fbd = openHeadlessFBDev(NULL, xres, yres, 0, &format);
+	if(!fbd) exit(1);
+	if(!(fbd->convert = findConverter(&fbd->format, kernel))) {
+		fbd->close(fbd);
+		return; // Not available for this format or CPU
+	}
+	if((threads > 1) && startSwapWorkersFBDev(fbd, threads, NULL)) exit(1);
+	fbd->damageMode = (workload == WL_FULL) ? FB_DAMAGE_FULL : (workload == WL_SPARSE) ? FB_DAMAGE_MANUAL : FB_DAMAGE_AUTO;
+	double *latency = malloc(frames * sizeof(double));
+	if(!latency) exit(1);
+	size_t bytes = 0;
+	double total = 0;
+	// The first swaps write everything, so leave them out
+	for(int frame = -3; frame < frames; frame++) {
+		drawFrame(fbd, workload, frame);
+		double start = now();
+		size_t written = fbd->swap(fbd);
+		double t = now() - start;
+		if(frame < 0) continue;
+		latency[frame] = t;
+		total += t;
+		bytes += written;
+	}
+	qsort(latency, frames, sizeof(double), compareDoubles);
+	printf("{\"format\": \"%s\", \"kernel\": \"%s\", \"threads\": %d, \"workload\": \"%s\", \"xres\": %d, \"yres\": %d, \"frames\": %d, "
+		"\"bytes_per_swap\": %zu, \"mb_per_s\": %.1f, \"swaps_per_s\": %.1f, \"min_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}\n",
+		f->name, kernel, threads, workloads[workload], xres, yres, frames,
+		bytes / frames, bytes / total / 1e6, frames / total,
+		latency[0] * 1e6, latency[frames / 2] * 1e6, latency[(frames * 99) / 100] * 1e6, latency[frames - 1] * 1e6);
+	fflush(stdout);
+	free(latency);
+	fbd->close(fbd);
+}
+
+int main(int argc, char **argv) {
+	int xres = 1920, yres = 1080, frames = 60;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *only = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "w:h:n:t:f:")) != -1) {
+		switch(opt) {
+		case 'w': xres = atoi(optarg); break;
+		case 'h': yres = atoi(optarg); break;
+		case 'n': frames = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'f': only = optarg; break;
+		default:
+			fprintf(stderr, "Usage: %s [-w xres] [-h yres] [-n frames] [-t threads] [-f format]\n", argv[0]);
+			return 1;
+		}
+	}
+	if((xres < 1) || (yres < 1) || (frames < 1)) return 1;
+	for(size_t f = 0; f < sizeof(formats) / sizeof(Format); f++) {
+		if(only && strcmp(only, formats[f].name)) continue;
+		for(size_t k = 0; k < sizeof(kernels) / sizeof(char *); k++) {
+			for(int w = WL_FULL; w <= WL_WORST; w++) {
+				run(&formats[f], kernels[k], 1, w, xres, yres, frames);
+				if(threads > 1) run(&formats[f], kernels[k], threads, w, xres, yres, frames);
+			}
+		}
+	}
+	return 0;
+}
@@ -15,34 +15,126 @@
  *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
-#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <time.h>
 
 #include "input.h"
+#include "record.h"
 
-#define SV_IDLE 0
-#define SV_SERVING 1
-#define SV_RESCAN 2
-#define SV_RESCANP 3
-#define SV_STOP -1
+// epoll data of the loopback: devices are identified by their index
+#define LOOPBACK_ID UINT32_MAX
+#define HOTPLUG_ID (UINT32_MAX - 1)
+#define REPLAY_ID (UINT32_MAX - 2)
+// Most ready file descriptors handled per wakeup
+#define EPOLL_BATCH 64
+// Events that fit in a device's buffer: a frame longer than this is delivered in parts
+#define BUFFER_EVENTS 128
+// Most reads from one device per wakeup, so that a busy device (or a file) can't hold up the others
+#define MAX_READS 4
+// Most recorded events played per wakeup, so that a replay as fast as possible can't hold up the devices
+#define REPLAY_BATCH (BUFFER_EVENTS * MAX_READS)
+
+// Events injected with loopbackEvent(s), queued by any number of threads for the one that serves events.
+// Producers reserve a run of positions by advancing tail, fill in the slots and publish each one by setting its seq.
+// The consumer takes slots in order while they are published and advances head, which frees them for reuse.
+struct loopback_ring {
+	uint64_t tail __attribute__((aligned(64))); // Next position to reserve
+	uint64_t head __attribute__((aligned(64))); // Next position to take
+	// Only used by the consumer: like a device's buffer, it keeps back a frame whose SYN_REPORT hasn't been taken yet
+	InputEvent held[BUFFER_EVENTS];
+	size_t num_held;
+	struct loopback_slot {
+		uint64_t seq; // position + 1 once the event for position has been written
+		InputEvent evt;
+	} slots[INPUT_LOOPBACK_EVENTS] __attribute__((aligned(64)));
+};
+
+// InputState guarded by a sequence lock: seq is odd while the thread serving events changes state,
+// and readers copy it until they see the same even seq before and after
+struct input_tracker {
+	uint32_t seq __attribute__((aligned(64)));
+	int loopback_slot; // The multitouch slot of loopback events
+	InputState state;
+};
+
+struct input_replay {
+	InputRecordings *recordings;
+	int timer_fd; // A timerfd that fires when the next event is due
+	double speed; // 0 to play as fast as possible
+	int started;
+	uint64_t start; // CLOCK_MONOTONIC nanoseconds when the first event was played
+	int64_t first; // Timestamp of the first event in microseconds
+	int waiting; // recordings->evt has been read but not played yet
+	size_t *devices; // Index in the table of each device named in the recordings, whose buffer holds its unfinished frame
+	size_t num_devices;
+	InputEvent held[BUFFER_EVENTS]; // Like a device's buffer, for loopback events
+	size_t num_held;
+	InputReplayStats stats;
+};
+
+// Motion of frames being merged, see filterInputEvents
+typedef struct motion {
+	size_t num; // Axes that moved, in the order they first did
+	InputEvent evts[REL_CNT + ABS_MT_SLOT];
+	InputEvent report; // The latest SYN_REPORT
+	uint8_t rel[REL_CNT], abs[ABS_MT_SLOT]; // 1 + index in evts of each axis, 0 if it hasn't moved
+} Motion;
+
+// Events passed from the thread serving events to the one pulling them. Each side only writes its own cache line,
+// and keeps a copy of the other side's position so it only has to read the shared one when the queue looks full or empty.
+struct input_queue {
+	// Written by the thread serving events
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t head_seen;
+	uint64_t queued, dropped;
+	// Written by the thread pulling events
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail_seen;
+	size_t capacity __attribute__((aligned(64)));
+	QueuedEvent slots[];
+};
+
+static int isEventDevice(const struct dirent *entry) {
+	return !strncmp(entry->d_name, "event", 5);
+}
 
 InputDevices *openInputDevices(void) {
-	// Generate default paths and call openInputDevicesPaths
-	char *final_paths[MAX_INPUT_DEVICES];
-	char paths[MAX_INPUT_DEVICES][INPUT_PATH_LEN];
-	for(int dev = 0; dev < MAX_INPUT_DEVICES; dev++) {
-		final_paths[dev] = paths[dev];
-		sprintf(paths[dev], "%s%d", INPUT_PATH, dev);
+	// List the event devices (in numerical order) and call openInputDevicesPaths
+	struct dirent **entries;
+	int num = scandir(INPUT_DIR, &entries, isEventDevice, versionsort);
+	if(num == -1) return openInputDevicesPaths(NULL, 0);
+	InputDevices *devices = NULL;
+	char **paths = calloc(num ? num : 1, sizeof(char *));
+	int made = 0;
+	if(paths) {
+		for(; made < num; made++) {
+			paths[made] = malloc(sizeof(INPUT_DIR "/") + strlen(entries[made]->d_name));
+			if(!paths[made]) break;
+			sprintf(paths[made], "%s/%s", INPUT_DIR, entries[made]->d_name);
+		}
+		if(made == num) devices = openInputDevicesPaths((const char **) paths, num);
+		for(int i = 0; i < made; i++) free(paths[i]);
+		free(paths);
 	}
-	return openInputDevicesPaths((const char **) final_paths, MAX_INPUT_DEVICES);
+	for(int i = 0; i < num; i++) free(entries[i]);
+	free(entries);
+	return devices;
 }
 
 static void dummyCallback(const InputEvent *evt, const InputDevice *dev, void *data) {
@@ -52,44 +144,283 @@ static void dummyCallback(const InputEvent *evt, const InputDevice *dev, void *d
 	return;
 }
 
-InputDevices *openInputDevicesPaths(const char **paths, size_t num_paths) {
-	InputDevices *devices = malloc(sizeof(InputDevices));
-	if(!devices) return NULL;
+static void beginChange(InputTracker *t) {
+	__atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-	if(pipe(devices->loopback) == -1) {
-		devices->loopback[0] = -1;
-		devices->loopback[1] = -1;
-		devices->loopback[2] = errno;
-	}
-
-	for(size_t dev = 0; dev < MAX_INPUT_DEVICES; dev++) {
-		// For each device:
-		// 	set the name
-		// 	if the name could be set (suficient memory and dev < num_paths) then open the file
-		if(dev < num_paths) {
-			size_t pathlen = strlen(paths[dev]) + 1;
-			devices->devices[dev].name = malloc(pathlen);
-			if(devices->devices[dev].name) {
-				memcpy(devices->devices[dev].name, paths[dev], pathlen);
-				devices->devices[dev].err = 0;
-			} else {
-				devices->devices[dev].fd = -1;
-				devices->devices[dev].err = errno;
-			}
-		} else {
-			devices->devices[dev].name = NULL;
-			devices->devices[dev].fd = -1;
-			devices->devices[dev].err = ENOENT;
+static void endChange(InputTracker *t) {
+	t->state.changes++;
+	__atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int testBit(const uint8_t *bits, int bit) {
+	return bits[bit / 8] & (1 << (bit % 8));
+}
+
+// Add what a device reports as held down, and the current values of its axes, to the state
+static void seedState(InputTracker *t, InputDevice *d) {
+	uint8_t keys[(KEY_CNT + 7) / 8] = {0}, axes[(ABS_CNT + 7) / 8] = {0};
+	struct {
+		uint32_t code;
+		int32_t values[INPUT_MT_SLOTS];
+	} mt;
+	static const uint32_t mtCodes[] = {ABS_MT_TRACKING_ID, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_PRESSURE};
+	// The device isn't evdev if these fail, and then there is nothing to add
+	int haveKeys = ioctl(d->fd, EVIOCGKEY(sizeof(keys)), keys) >= 0;
+	int haveAxes = ioctl(d->fd, EVIOCGBIT(EV_ABS, sizeof(axes)), axes) >= 0;
+	d->mt_slot = 0;
+	if(!haveKeys && !haveAxes) return;
+	beginChange(t);
+	for(int k = 0; haveKeys && (k < KEY_CNT); k++) {
+		if(testBit(keys, k)) t->state.keys[k / 64] |= (uint64_t)1 << (k % 64);
+	}
+	for(int a = 0; haveAxes && (a < ABS_CNT); a++) {
+		struct input_absinfo info;
+		if(!testBit(axes, a) || (ioctl(d->fd, EVIOCGABS(a), &info) == -1)) continue;
+		t->state.abs[a] = info.value;
+		if(a == ABS_MT_SLOT) d->mt_slot = info.value;
+	}
+	for(size_t c = 0; haveAxes && testBit(axes, ABS_MT_SLOT) && (c < sizeof(mtCodes) / sizeof(mtCodes[0])); c++) {
+		mt.code = mtCodes[c];
+		if(!testBit(axes, mt.code) || (ioctl(d->fd, EVIOCGMTSLOTS(sizeof(mt)), &mt) == -1)) continue;
+		for(int slot = 0; slot < INPUT_MT_SLOTS; slot++) {
+			struct input_touch *touch = &t->state.touches[slot];
+			if(mt.code == ABS_MT_TRACKING_ID) touch->id = mt.values[slot];
+			else if(mt.code == ABS_MT_POSITION_X) touch->x = mt.values[slot];
+			else if(mt.code == ABS_MT_POSITION_Y) touch->y = mt.values[slot];
+			else touch->pressure = mt.values[slot];
 		}
-		if(!devices->devices[dev].err) {
-			devices->devices[dev].fd = open(devices->devices[dev].name, O_RDONLY);
-			if(devices->devices[dev].fd == -1) {
-				devices->devices[dev].err = errno;
-			}
+	}
+	endChange(t);
+}
+
+// Apply events from dev (NULL for loopback events) to the state
+static void updateState(InputTracker *t, InputDevice *dev, const InputEvent *evts, size_t num) {
+	int *slot = dev ? &dev->mt_slot : &t->loopback_slot;
+	if(!num) return;
+	beginChange(t);
+	for(size_t i = 0; i < num; i++) {
+		const InputEvent *e = &evts[i];
+		struct input_touch *touch = ((*slot >= 0) && (*slot < INPUT_MT_SLOTS)) ? &t->state.touches[*slot] : NULL;
+		if((e->type == EV_KEY) && (e->code < KEY_CNT)) {
+			// A value of 2 is an autorepeat, so the key is still down
+			if(e->value) t->state.keys[e->code / 64] |= (uint64_t)1 << (e->code % 64);
+			else t->state.keys[e->code / 64] &= ~((uint64_t)1 << (e->code % 64));
+		} else if((e->type == EV_REL) && (e->code < REL_CNT)) {
+			t->state.rel[e->code] += e->value;
+		} else if((e->type == EV_ABS) && (e->code < ABS_CNT)) {
+			t->state.abs[e->code] = e->value;
+			if(e->code == ABS_MT_SLOT) *slot = e->value;
+			else if(touch && (e->code == ABS_MT_TRACKING_ID)) touch->id = e->value;
+			else if(touch && (e->code == ABS_MT_POSITION_X)) touch->x = e->value;
+			else if(touch && (e->code == ABS_MT_POSITION_Y)) touch->y = e->value;
+			else if(touch && (e->code == ABS_MT_PRESSURE)) touch->pressure = e->value;
+		}
+		t->state.time = e->time;
+	}
+	endChange(t);
+}
+
+// Have the kernel drop events of types the device doesn't want
+static void maskDevice(const InputDevice *d) {
+#ifdef EVIOCSMASK
+	static const struct {
+		uint16_t type, count;
+	} maskable[] = {
+		{EV_KEY, KEY_CNT}, {EV_REL, REL_CNT}, {EV_ABS, ABS_CNT}, {EV_MSC, MSC_CNT},
+		{EV_SW, SW_CNT}, {EV_LED, LED_CNT}, {EV_SND, SND_CNT}, {EV_FF, FF_CNT},
+	};
+	uint8_t codes[(KEY_CNT + 7) / 8];
+	for(size_t i = 0; i < sizeof(maskable) / sizeof(maskable[0]); i++) {
+		struct input_mask mask = {
+			.type = maskable[i].type,
+			.codes_size = (maskable[i].count + 7) / 8,
+			.codes_ptr = (uintptr_t)codes,
+		};
+		memset(codes, (d->types & (1u << maskable[i].type)) ? 0xff : 0, mask.codes_size);
+		// Not an evdev device, or a kernel before 4.4: events are dropped after reading instead
+		if(ioctl(d->fd, EVIOCSMASK, &mask) == -1) return;
+	}
+#endif
+}
+
+// Open a device by its name and watch it for events, setting err on failure
+static void openDevice(InputDevices *devices, size_t dev) {
+	InputDevice *d = &devices->devices[dev];
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = dev,
+	};
+	d->buffered = 0;
+	d->frame_kept = 0;
+	d->fd = open(d->name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if(d->fd == -1) {
+		d->err = errno;
+	} else if(!d->buffer && !(d->buffer = malloc(BUFFER_EVENTS * sizeof(InputEvent)))) {
+		d->err = errno;
+		close(d->fd);
+		d->fd = -1;
+	} else if(epoll_ctl(devices->epoll_fd, EPOLL_CTL_ADD, d->fd, &ev) == -1) {
+		if(errno == EPERM) {
+			// A regular file can always be read
+			d->always_ready = 1;
+			d->err = 0;
+			devices->num_always_ready++;
+			return;
+		}
+		d->err = errno;
+		close(d->fd);
+		d->fd = -1;
+	} else {
+		d->err = 0;
+	}
+	if((d->fd != -1) && (d->types != INPUT_ALL_TYPES)) maskDevice(d);
+	if((d->fd != -1) && (devices->clock != CLOCK_REALTIME)) ioctl(d->fd, EVIOCSCLOCKID, &devices->clock);
+	if((d->fd != -1) && devices->tracker) seedState(devices->tracker, d);
+}
+
+// Stop watching a device and close it, dropping anything buffered: err is kept unless closing fails
+static void closeDevice(InputDevices *devices, size_t dev) {
+	InputDevice *d = &devices->devices[dev];
+	free(d->buffer);
+	d->buffer = NULL;
+	d->buffered = 0;
+	if(d->fd == -1) return;
+	if(d->always_ready) {
+		d->always_ready = 0;
+		devices->num_always_ready--;
+	} else {
+		epoll_ctl(devices->epoll_fd, EPOLL_CTL_DEL, d->fd, NULL);
+	}
+	if(close(d->fd) == -1) d->err = errno;
+	d->fd = -1;
+}
+
+static void openLoopback(InputDevices *devices) {
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = LOOPBACK_ID,
+	};
+	void *ring;
+	devices->loopback = NULL;
+	devices->loopback_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(devices->loopback_fd == -1) {
+		devices->loopback_err = errno;
+	} else if((devices->loopback_err = posix_memalign(&ring, 64, sizeof(LoopbackRing)))) {
+		close(devices->loopback_fd);
+		devices->loopback_fd = -1;
+	} else if(epoll_ctl(devices->epoll_fd, EPOLL_CTL_ADD, devices->loopback_fd, &ev) == -1) {
+		devices->loopback_err = errno;
+		free(ring);
+		close(devices->loopback_fd);
+		devices->loopback_fd = -1;
+	} else {
+		devices->loopback = memset(ring, 0, sizeof(LoopbackRing));
+		devices->loopback_err = 0;
+	}
+}
+
+static void closeLoopback(InputDevices *devices) {
+	if(devices->loopback_fd == -1) return;
+	epoll_ctl(devices->epoll_fd, EPOLL_CTL_DEL, devices->loopback_fd, NULL);
+	close(devices->loopback_fd);
+	devices->loopback_fd = -1;
+	free(devices->loopback);
+	devices->loopback = NULL;
+}
+
+// Stop the replay's timer and close the recordings, keeping its statistics
+static void releaseReplay(InputDevices *devices) {
+	InputReplay *p = devices->replay;
+	if(p->timer_fd != -1) {
+		epoll_ctl(devices->epoll_fd, EPOLL_CTL_DEL, p->timer_fd, NULL);
+		close(p->timer_fd);
+		p->timer_fd = -1;
+	}
+	closeInputRecordings(p->recordings);
+	p->recordings = NULL;
+}
+
+static void closeReplay(InputDevices *devices) {
+	InputReplay *p = devices->replay;
+	if(!p) return;
+	releaseReplay(devices);
+	free(p->devices);
+	free(p);
+	devices->replay = NULL;
+}
+
+// Wake the thread serving events, even if the loopback is full
+static void wakeServer(InputDevices *devices) {
+	uint64_t one = 1;
+	if(write(devices->loopback_fd, &one, sizeof(one)) == -1) devices->loopback_err = errno;
+}
+
+// Wake the thread serving events with a KEY_EXIT frame once serving is SV_STOP, and wait for it to finish
+static void stopServer(InputDevices *devices) {
+	InputEvent evts[2] = {
+		{.type = EV_KEY, .code = KEY_EXIT},
+		{.type = EV_SYN, .code = SYN_REPORT},
+	};
+	if(loopbackEvents(devices, evts, 2) < 2) wakeServer(devices);
+	pthread_join(devices->serverthread, NULL);
+}
+
+// Replace the names of the devices with paths, resizing the table to match.
+// Devices must be closed first. Returns -1 if the table couldn't be resized.
+static int setNames(InputDevices *devices, const char **paths, size_t num_paths) {
+	for(size_t dev = 0; dev < devices->num_devices; dev++) free(devices->devices[dev].name);
+	if(num_paths != devices->num_devices) {
+		InputDevice *resized = realloc(devices->devices, (num_paths ? num_paths : 1) * sizeof(InputDevice));
+		if(!resized) {
+			devices->num_devices = 0;
+			return -1;
+		}
+		devices->devices = resized;
+		devices->num_devices = num_paths;
+		devices->max_devices = num_paths;
+	}
+	for(size_t dev = 0; dev < num_paths; dev++) {
+		size_t pathlen = strlen(paths[dev]) + 1;
+		devices->devices[dev].fd = -1;
+		devices->devices[dev].always_ready = 0;
+		devices->devices[dev].types = devices->types;
+		devices->devices[dev].coalesce = devices->coalesce;
+		devices->devices[dev].buffer = NULL;
+		devices->devices[dev].buffered = 0;
+		devices->devices[dev].name = malloc(pathlen);
+		if(devices->devices[dev].name) {
+			memcpy(devices->devices[dev].name, paths[dev], pathlen);
+			devices->devices[dev].err = 0;
+		} else {
+			devices->devices[dev].err = errno;
 		}
 	}
+	return 0;
+}
+
+InputDevices *openInputDevicesPaths(const char **paths, size_t num_paths) {
+	InputDevices *devices = calloc(1, sizeof(InputDevices));
+	if(!devices) return NULL;
+	devices->hotplug_fd = -1;
+	devices->types = INPUT_ALL_TYPES;
+	devices->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if((devices->epoll_fd == -1) || setNames(devices, paths, num_paths)) {
+		if(devices->epoll_fd != -1) close(devices->epoll_fd);
+		for(size_t dev = 0; dev < devices->num_devices; dev++) free(devices->devices[dev].name);
+		free(devices->devices);
+		free(devices);
+		return NULL;
+	}
+	openLoopback(devices);
+	for(size_t dev = 0; dev < devices->num_devices; dev++) {
+		// Devices without a name (out of memory) keep their error
+		if(devices->devices[dev].name) openDevice(devices, dev);
+	}
 	devices->serving = SV_IDLE;
 	devices->callback = dummyCallback;
+	devices->frame_callback = NULL;
 	devices->callback_data = NULL;
 	// Success!
 	return devices;
@@ -100,25 +431,25 @@ int closeInputDevices(InputDevices *devices) {
 		devices->serving = SV_STOP;
 	} else if(devices->serving == SV_SERVING) {
 		devices->serving = SV_STOP;
-			InputEvent evt = {
-			.type = EV_KEY,
-			.code = KEY_EXIT,
-		};
-		loopbackEvent(devices, &evt);
-		pthread_join(devices->serverthread, NULL);
+		stopServer(devices);
 	} else {
 		return -1;
 	}
-	for(size_t dev = 0; dev < MAX_INPUT_DEVICES; dev++) {
+	stopRecordingInputEvents(devices);
+	closeReplay(devices);
+	for(size_t dev = 0; dev < devices->num_devices; dev++) {
+		closeDevice(devices, dev);
 		free(devices->devices[dev].name);
-		if(devices->devices[dev].fd != -1) {
-			close(devices->devices[dev].fd);
-		}
-	}
-	if(devices->loopback[0] != -1) {
-		close(devices->loopback[0]);
-		close(devices->loopback[1]);
 	}
+	free(devices->devices);
+	for(size_t t = 0; t < devices->num_old_tables; t++) free(devices->old_tables[t]);
+	free(devices->old_tables);
+	if(devices->hotplug_fd != -1) close(devices->hotplug_fd);
+	free(devices->hotplug_dir);
+	closeLoopback(devices);
+	close(devices->epoll_fd);
+	free(devices->queue);
+	free(devices->tracker);
 	free(devices);
 	return 0;
 }
@@ -126,105 +457,519 @@ int closeInputDevices(InputDevices *devices) {
 int rescanInputDevices(InputDevices *devices) {
 	if((devices->serving != SV_IDLE) && (devices->serving != SV_RESCANP)) return -1;
 	devices->serving = SV_RESCAN;
-	for(size_t dev = 0; dev < MAX_INPUT_DEVICES; dev++) {
-		if(devices->devices[dev].name) {
-			if(devices->devices[dev].fd != -1) {
-				close(devices->devices[dev].fd);
-			}
-			devices->devices[dev].fd = open(devices->devices[dev].name, O_RDONLY);
-			devices->devices[dev].err = (devices->devices[dev].fd == -1) ? errno : 0;
-		} else {
-			if(devices->devices[dev].fd != -1) {
-				devices->devices[dev].err = (close(devices->devices[dev].fd) == -1) ? errno : 0;
-			}
-			devices->devices[dev].fd == -1;
-		}
-	}
-	if(devices->loopback[0] == -1) {
-		devices->loopback[3] = (pipe(devices->loopback) == -1) ? errno : 0;
+	for(size_t dev = 0; dev < devices->num_devices; dev++) {
+		closeDevice(devices, dev);
+		if(devices->devices[dev].name) openDevice(devices, dev);
 	}
+	if(devices->loopback_fd == -1) openLoopback(devices);
 	devices->serving = SV_IDLE;
+	return 0;
 }
 
 int rescanInputDevicesPaths(InputDevices *devices, const char **paths, size_t num_paths) {
 	if(devices->serving != SV_IDLE) return -1;
 	devices->serving = SV_RESCANP;
 	// Set names then call rescanInputDevices
-	for(size_t dev = 0; dev < MAX_INPUT_DEVICES; dev++) {
-		free(devices->devices[dev].name); // Freeing NULL is allowed
-		if(dev < num_paths) {
-			size_t pathlen = strlen(paths[dev]) + 1;
-			devices->devices[dev].name = malloc(pathlen);
-			if(devices->devices[dev].name) {
-				memcpy(devices->devices[dev].name, paths[dev], pathlen);
-			} else {
-				devices->devices[dev].err = errno;
-			}
+	for(size_t dev = 0; dev < devices->num_devices; dev++) closeDevice(devices, dev);
+	if(setNames(devices, paths, num_paths)) {
+		devices->serving = SV_IDLE;
+		return -1;
+	}
+	return rescanInputDevices(devices); // This should set devices->serving to SV_IDLE
+}
+
+static int isReport(const InputEvent *evt) {
+	return (evt->type == EV_SYN) && (evt->code == SYN_REPORT);
+}
+
+// Add a frame to the queue if there is room for all of it
+static void queueFrame(InputDevices *devices, const InputDevice *dev, const InputEvent *evts, size_t num) {
+	InputQueue *q = devices->queue;
+	uint64_t tail = q->tail;
+	if(q->capacity - (tail - q->head_seen) < num) {
+		q->head_seen = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if(q->capacity - (tail - q->head_seen) < num) {
+			__atomic_store_n(&q->dropped, q->dropped + num, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	int device = dev ? dev - devices->devices : -1;
+	for(size_t i = 0; i < num; i++) {
+		QueuedEvent *slot = &q->slots[(tail + i) & (q->capacity - 1)];
+		slot->evt = evts[i];
+		slot->device = device;
+	}
+	__atomic_store_n(&q->tail, tail + num, __ATOMIC_RELEASE);
+	__atomic_store_n(&q->queued, q->queued + num, __ATOMIC_RELAXED);
+}
+
+static void deliverFrame(InputDevices *devices, const InputDevice *dev, const InputEvent *evts, size_t num) {
+	if(devices->queue) {
+		queueFrame(devices, dev, evts, num);
+	} else {
+		devices->frame_callback(evts, num, dev, devices->callback_data);
+	}
+}
+
+// Pass events to the callbacks or the queue: frame_callback and the queue get each frame up to and including its SYN_REPORT.
+// If hold is set a frame without its SYN_REPORT yet is kept back. Returns the number of events delivered.
+static size_t deliverEvents(InputDevices *devices, InputDevice *dev, const InputEvent *evts, size_t num, int hold) {
+	if(devices->tracker) {
+		// The state changes before anything sees the events
+		size_t apply = num;
+		if(hold && (devices->frame_callback || devices->queue)) {
+			while(apply && !isReport(&evts[apply - 1])) apply--;
+		}
+		updateState(devices->tracker, dev, evts, apply);
+	}
+	if(!devices->frame_callback && !devices->queue) {
+		for(size_t i = 0; i < num; i++) devices->callback(&evts[i], dev, devices->callback_data);
+		if(devices->recorder) recordEvents(devices, dev, evts, num);
+		return num;
+	}
+	size_t start = 0;
+	for(size_t i = 0; i < num; i++) {
+		if(isReport(&evts[i])) {
+			deliverFrame(devices, dev, evts + start, i + 1 - start);
+			start = i + 1;
+		}
+	}
+	if(!hold && (start < num)) {
+		deliverFrame(devices, dev, evts + start, num - start);
+		start = num;
+	}
+	if(devices->recorder) recordEvents(devices, dev, evts, start);
+	return start;
+}
+
+static int isWanted(const InputDevice *d, const InputEvent *evt) {
+	return (evt->type == EV_SYN) || ((evt->type < 32) && (d->types & (1u << evt->type)));
+}
+
+static int isMotion(const InputEvent *evts, size_t num) {
+	for(size_t i = 0; i < num; i++) {
+		if(!(((evts[i].type == EV_REL) && (evts[i].code < REL_CNT)) || ((evts[i].type == EV_ABS) && (evts[i].code < ABS_MT_SLOT)))) return 0;
+	}
+	return 1;
+}
+
+static void addMotion(Motion *m, const InputEvent *evts, size_t num, const InputEvent *report) {
+	for(size_t i = 0; i < num; i++) {
+		uint8_t *index = (evts[i].type == EV_REL) ? &m->rel[evts[i].code] : &m->abs[evts[i].code];
+		if(!*index) {
+			m->evts[m->num] = evts[i];
+			*index = ++m->num;
+		} else if(evts[i].type == EV_REL) {
+			m->evts[*index - 1].value += evts[i].value;
+			m->evts[*index - 1].time = evts[i].time;
 		} else {
-			devices->devices[dev].name = NULL;
+			m->evts[*index - 1] = evts[i];
 		}
 	}
-	return rescanInputDevices(devices); // This should set devices->serving to SV_IDLE
+	m->report = *report;
 }
 
-static void serveEvents(InputDevices *devices, int wait) {
-	fd_set dev_fds;
-	struct timeval tv = {0};
-	FD_ZERO(&dev_fds);
-	int maxfd = -1;
-	for(size_t dev = 0; dev < MAX_INPUT_DEVICES; dev++) {
-		if(devices->devices[dev].fd != -1) {
-			FD_SET(devices->devices[dev].fd, &dev_fds);
-			maxfd = (devices->devices[dev].fd > maxfd) ? devices->devices[dev].fd : maxfd;
+// Write the merged motion as one frame to out, returns the number of events written
+static size_t takeMotion(Motion *m, InputEvent *out) {
+	if(!m->num) return 0;
+	size_t num = m->num;
+	memcpy(out, m->evts, num * sizeof(InputEvent));
+	out[num++] = m->report;
+	m->num = 0;
+	memset(m->rel, 0, sizeof(m->rel));
+	memset(m->abs, 0, sizeof(m->abs));
+	return num;
+}
+
+// As deliverEvents, dropping events d doesn't want and frames left empty, and merging motion if d coalesces
+static size_t deliverFiltered(InputDevices *devices, InputDevice *d, const InputEvent *evts, size_t num, int hold) {
+	InputEvent out[BUFFER_EVENTS]; // Filtering and merging never make more events
+	Motion motion = {0};
+	size_t used = 0, n = 0;
+	for(size_t i = 0; i < num; i++) {
+		if(!isReport(&evts[i])) continue;
+		// evts[used] to evts[i] is a whole frame
+		size_t first = n;
+		for(size_t k = used; k < i; k++) {
+			if(isWanted(d, &evts[k])) out[n++] = evts[k];
 		}
+		if(d->coalesce && (n > first) && !d->frame_kept && isMotion(out + first, n - first)) {
+			addMotion(&motion, out + first, n - first, &evts[i]);
+			n = first;
+		} else {
+			// Motion merged so far goes before this frame
+			size_t merged = motion.num ? motion.num + 1 : 0;
+			memmove(out + first + merged, out + first, (n - first) * sizeof(InputEvent));
+			takeMotion(&motion, out + first);
+			n += merged;
+			if((n > first + merged) || d->frame_kept) out[n++] = evts[i];
+			d->frame_kept = 0;
+		}
+		used = i + 1;
 	}
-	if(devices->loopback[0] != -1) {
-		FD_SET(devices->loopback[0], &dev_fds);
-		maxfd = (devices->loopback[0] > maxfd) ? devices->loopback[0] : maxfd;
-	}
-	select(maxfd + 1, &dev_fds, NULL, NULL, wait ? NULL : &tv);
-	InputEvent evt;
-	ssize_t r;
-	for(size_t dev = 0; dev < MAX_INPUT_DEVICES; dev++) {
-		if(FD_ISSET(devices->devices[dev].fd, &dev_fds)) {
-			r = read(devices->devices[dev].fd, &evt, sizeof(InputEvent));
-			if(r == -1) {
-				// Error
-				devices->devices[dev].err = errno;
-				close(devices->devices[dev].fd);
-				devices->devices[dev].fd = -1;
-			} else if(r == 0) {
-				// EOF (device disconnected)
-				devices->devices[dev].err = (close(devices->devices[dev].fd) == 0) ? 0 : errno;
-				devices->devices[dev].fd = -1;
-			} else if(r == sizeof(InputEvent)) {
-				// Success!
-				devices->callback(&evt, &devices->devices[dev], devices->callback_data);
-			} else {
-				// Short read - it isn't safe to continue in this case
-				// Treat it as an error
-				close(devices->devices[dev].fd);
-				devices->devices[dev].fd = -1;
-				devices->devices[dev].err = EIO; // An IO error (probably) didn't actually occur, but pretend that it did.
+	n += takeMotion(&motion, out + n);
+	// The start of an unfinished frame goes out now if it isn't being held back
+	if(!hold || (!devices->frame_callback && !devices->queue)) {
+		for(; used < num; used++) {
+			if(isWanted(d, &evts[used])) {
+				out[n++] = evts[used];
+				d->frame_kept = 1;
 			}
 		}
 	}
-	if(FD_ISSET(devices->loopback[0], &dev_fds)) {
-		r = read(devices->loopback[0], &evt, sizeof(InputEvent));
+	deliverEvents(devices, d, out, n, 0);
+	return used;
+}
+
+// Deliver events from d (NULL for loopback events), filtered if it wants
+static size_t deliverFrom(InputDevices *devices, InputDevice *d, const InputEvent *evts, size_t num, int hold) {
+	if(d && ((d->types != INPUT_ALL_TYPES) || d->coalesce)) return deliverFiltered(devices, d, evts, num, hold);
+	return deliverEvents(devices, d, evts, num, hold);
+}
+
+// Deliver what is in a device's buffer and keep the rest (an unfinished frame or part of an event) at its start
+static void deliverBuffered(InputDevices *devices, InputDevice *d, int hold) {
+	size_t complete = d->buffered / sizeof(InputEvent);
+	size_t done = deliverFrom(devices, d, d->buffer, complete, hold);
+	// A frame that fills the whole buffer is delivered in parts
+	if(!done && (complete == BUFFER_EVENTS)) done = deliverFrom(devices, d, d->buffer, complete, 0);
+	d->buffered -= done * sizeof(InputEvent);
+	memmove(d->buffer, d->buffer + done, d->buffered);
+}
+
+// Close a device that failed or went away while serving events, and tell the application
+static void dropDevice(InputDevices *devices, size_t dev, int err) {
+	devices->devices[dev].err = err;
+	closeDevice(devices, dev);
+	if(devices->hotplug_callback && ((devices->hotplug_fd != -1) || devices->replay)) devices->hotplug_callback(&devices->devices[dev], 0, devices->callback_data);
+}
+
+static void readDevice(InputDevices *devices, size_t dev) {
+	InputDevice *d = &devices->devices[dev];
+	for(int reads = 0; reads < MAX_READS; reads++) {
+		size_t space = BUFFER_EVENTS * sizeof(InputEvent) - d->buffered;
+		ssize_t r = read(d->fd, (char *)d->buffer + d->buffered, space);
 		if(r == -1) {
-			devices->loopback[2] = errno;
-			close(devices->loopback[0]);
-			close(devices->loopback[1]);
-			devices->loopback[0] = -1;
-			devices->loopback[1] = -1;
-		} else if(r == sizeof(InputEvent)) {
-			devices->callback(&evt, NULL, devices->callback_data);
-		} else {
-			close(devices->loopback[0]);
-			close(devices->loopback[1]);
-			devices->loopback[0] = -1;
-			devices->loopback[1] = -1;
-			devices->loopback[2] = EIO;
+			if(errno == EINTR) continue;
+			if((errno == EAGAIN) || (errno == EWOULDBLOCK)) return; // Drained
+			// Error (ENODEV if it was unplugged)
+			dropDevice(devices, dev, errno);
+			return;
+		} else if(r == 0) {
+			// EOF (device disconnected): whole events that are left still count
+			// A partial event at the end isn't safe to deliver, so treat it as an error
+			deliverBuffered(devices, d, 0);
+			dropDevice(devices, dev, d->buffered ? EIO : 0); // An IO error (probably) didn't actually occur, but pretend that it did.
+			return;
+		}
+		// Success!
+		d->buffered += r;
+		deliverBuffered(devices, d, 1);
+		if((size_t)r < space) return; // Nothing more to read yet
+	}
+}
+
+// Take up to max published events from the loopback
+static size_t takeLoopback(LoopbackRing *ring, InputEvent *evts, size_t max) {
+	uint64_t head = ring->head; // Only this thread changes head
+	size_t num = 0;
+	for(; num < max; num++) {
+		struct loopback_slot *slot = &ring->slots[(head + num) % INPUT_LOOPBACK_EVENTS];
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + num + 1) break;
+		evts[num] = slot->evt;
+	}
+	__atomic_store_n(&ring->head, head + num, __ATOMIC_RELEASE);
+	return num;
+}
+
+static void readLoopback(InputDevices *devices) {
+	uint64_t count;
+	// Reset the eventfd before taking events: any published later signal it again
+	if((read(devices->loopback_fd, &count, sizeof(count)) == -1) && (errno != EAGAIN)) devices->loopback_err = errno;
+	LoopbackRing *ring = devices->loopback;
+	size_t num;
+	while((num = takeLoopback(ring, ring->held + ring->num_held, BUFFER_EVENTS - ring->num_held))) {
+		ring->num_held += num;
+		size_t done = deliverEvents(devices, NULL, ring->held, ring->num_held, 1);
+		// A frame that fills the whole buffer is delivered in parts
+		if(!done && (ring->num_held == BUFFER_EVENTS)) done = deliverEvents(devices, NULL, ring->held, ring->num_held, 0);
+		ring->num_held -= done;
+		memmove(ring->held, ring->held + done, ring->num_held * sizeof(InputEvent));
+	}
+}
+
+static ssize_t findDevice(const InputDevices *devices, const char *path) {
+	for(size_t dev = 0; dev < devices->num_devices; dev++) {
+		if(devices->devices[dev].name && !strcmp(devices->devices[dev].name, path)) return dev;
+	}
+	return -1;
+}
+
+// Add a device to the end of the table, returns its index or -1 on failure.
+// A full table is copied into a bigger one, but kept: another thread may have just read devices->devices.
+static ssize_t addDevice(InputDevices *devices, const char *path) {
+	if(devices->num_devices == devices->max_devices) {
+		size_t max = devices->max_devices ? devices->max_devices * 2 : 16;
+		InputDevice **old = realloc(devices->old_tables, (devices->num_old_tables + 1) * sizeof(InputDevice *));
+		if(!old) return -1;
+		devices->old_tables = old;
+		InputDevice *table = malloc(max * sizeof(InputDevice));
+		if(!table) return -1;
+		memcpy(table, devices->devices, devices->num_devices * sizeof(InputDevice));
+		devices->old_tables[devices->num_old_tables++] = devices->devices;
+		devices->devices = table;
+		devices->max_devices = max;
+	}
+	InputDevice *d = &devices->devices[devices->num_devices];
+	if(!(d->name = strdup(path))) return -1;
+	d->fd = -1;
+	d->err = 0;
+	d->always_ready = 0;
+	d->types = devices->types;
+	d->coalesce = devices->coalesce;
+	d->buffer = NULL;
+	d->buffered = 0;
+	d->frame_kept = 0;
+	d->mt_slot = 0;
+	return devices->num_devices++;
+}
+
+// Open the device at path if it isn't open already, reusing its place in the table if it has been open before
+static void plugDevice(InputDevices *devices, const char *path) {
+	ssize_t dev = findDevice(devices, path);
+	if(dev == -1) dev = addDevice(devices, path);
+	if((dev == -1) || (devices->devices[dev].fd != -1)) return;
+	openDevice(devices, dev);
+	// It may not be readable yet: it is tried again when its permissions change
+	if((devices->devices[dev].fd != -1) && devices->hotplug_callback) devices->hotplug_callback(&devices->devices[dev], 1, devices->callback_data);
+}
+
+static void unplugDevice(InputDevices *devices, const char *path) {
+	ssize_t dev = findDevice(devices, path);
+	if(dev == -1) return;
+	if(devices->devices[dev].fd != -1) {
+		dropDevice(devices, dev, ENODEV);
+	} else {
+		devices->devices[dev].err = ENODEV;
+	}
+}
+
+static char *devicePath(const InputDevices *devices, const char *name) {
+	char *path = malloc(strlen(devices->hotplug_dir) + strlen(name) + 2);
+	if(path) sprintf(path, "%s/%s", devices->hotplug_dir, name);
+	return path;
+}
+
+// Open every event device in the watched directory that isn't open
+static void plugAll(InputDevices *devices) {
+	struct dirent **entries;
+	int num = scandir(devices->hotplug_dir, &entries, isEventDevice, versionsort);
+	for(int i = 0; i < num; i++) {
+		char *path = devicePath(devices, entries[i]->d_name);
+		if(path) plugDevice(devices, path);
+		free(path);
+		free(entries[i]);
+	}
+	if(num != -1) free(entries);
+}
+
+static void readHotplug(InputDevices *devices) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while((len = read(devices->hotplug_fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+		for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if(ev->mask & IN_Q_OVERFLOW) {
+				// Some were missed: removed devices show up as read errors, but new ones have to be looked for
+				plugAll(devices);
+				continue;
+			}
+			if(!ev->len || strncmp(ev->name, "event", 5)) continue;
+			char *path = devicePath(devices, ev->name);
+			if(!path) continue;
+			if(ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				unplugDevice(devices, path);
+			} else {
+				plugDevice(devices, path);
+			}
+			free(path);
+		}
+	}
+}
+
+int watchInputDevices(InputDevices *devices, const char *dir) {
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = HOTPLUG_ID,
+	};
+	if(devices->hotplug_fd != -1) return 1;
+	if(devices->serving != SV_IDLE) return -1;
+	if(!(devices->hotplug_dir = strdup(dir ? dir : INPUT_DIR))) return -1;
+	devices->hotplug_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	// Device nodes are often created before udev lets us read them, so changes of permissions count too
+	if((devices->hotplug_fd == -1)
+		|| (inotify_add_watch(devices->hotplug_fd, devices->hotplug_dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) == -1)
+		|| (epoll_ctl(devices->epoll_fd, EPOLL_CTL_ADD, devices->hotplug_fd, &ev) == -1)) {
+		if(devices->hotplug_fd != -1) close(devices->hotplug_fd);
+		devices->hotplug_fd = -1;
+		free(devices->hotplug_dir);
+		devices->hotplug_dir = NULL;
+		return -1;
+	}
+	// Anything created before the watch started
+	plugAll(devices);
+	return 0;
+}
+
+static uint64_t monotonicNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Have the replay's timer fire at the CLOCK_MONOTONIC time due, or straight away if that has passed
+static void armReplay(InputReplay *p, uint64_t due) {
+	struct itimerspec when = {
+		.it_value.tv_sec = due / 1000000000,
+		.it_value.tv_nsec = due % 1000000000,
+	};
+	if(timerfd_settime(p->timer_fd, TFD_TIMER_ABSTIME, &when, NULL) == -1) p->stats.error = errno;
+}
+
+// Add the devices named in the recordings since last time to the table. Returns -1 on failure.
+static int addReplayDevices(InputDevices *devices) {
+	InputReplay *p = devices->replay;
+	InputRecordings *r = p->recordings;
+	if(p->num_devices == r->num_names) return 0;
+	size_t *grown = realloc(p->devices, r->num_names * sizeof(size_t));
+	if(!grown) return -1;
+	p->devices = grown;
+	for(; p->num_devices < r->num_names; p->num_devices++) {
+		ssize_t dev = addDevice(devices, r->names[p->num_devices]);
+		if(dev == -1) return -1;
+		InputDevice *d = &devices->devices[dev];
+		if(!(d->buffer = malloc(BUFFER_EVENTS * sizeof(InputEvent)))) return -1;
+		p->devices[p->num_devices] = dev;
+		if(devices->hotplug_callback) devices->hotplug_callback(d, 1, devices->callback_data);
+	}
+	return 0;
+}
+
+// Events held back for a recorded device (-1 for loopback events)
+static size_t numHeld(InputDevices *devices, int device) {
+	InputReplay *p = devices->replay;
+	if(device == -1) return p->num_held;
+	return devices->devices[p->devices[device]].buffered / sizeof(InputEvent);
+}
+
+// Deliver the events held for a recorded device. If hold is set an unfinished frame is kept back,
+// unless it fills the whole buffer, and it is delivered in parts.
+static void playHeld(InputDevices *devices, int device, int hold) {
+	InputReplay *p = devices->replay;
+	if(device != -1) {
+		deliverBuffered(devices, &devices->devices[p->devices[device]], hold);
+		return;
+	}
+	size_t done = deliverEvents(devices, NULL, p->held, p->num_held, hold);
+	if(!done && (p->num_held == BUFFER_EVENTS)) done = deliverEvents(devices, NULL, p->held, p->num_held, 0);
+	p->num_held -= done;
+	memmove(p->held, p->held + done, p->num_held * sizeof(InputEvent));
+}
+
+static void holdEvent(InputDevices *devices, int device, const InputEvent *evt) {
+	InputReplay *p = devices->replay;
+	if(numHeld(devices, device) == BUFFER_EVENTS) playHeld(devices, device, 1);
+	if(device == -1) {
+		p->held[p->num_held++] = *evt;
+	} else {
+		InputDevice *d = &devices->devices[p->devices[device]];
+		d->buffer[d->buffered / sizeof(InputEvent)] = *evt;
+		d->buffered += sizeof(InputEvent);
+	}
+	__atomic_store_n(&p->stats.events, p->stats.events + 1, __ATOMIC_RELAXED);
+}
+
+// Every recording has been played (or one couldn't be read): deliver what is left, close the devices in them
+// and let go of the recordings, keeping the statistics until the next replay
+static void finishReplay(InputDevices *devices, int err) {
+	InputReplay *p = devices->replay;
+	playHeld(devices, -1, 0);
+	for(size_t dev = 0; dev < p->num_devices; dev++) {
+		playHeld(devices, dev, 0);
+		dropDevice(devices, p->devices[dev], err);
+	}
+	releaseReplay(devices);
+	if(err) p->stats.error = err;
+	__atomic_store_n(&p->stats.finished, 1, __ATOMIC_RELEASE);
+}
+
+// Play the recorded events that are due, then wait for the next. Each device's events are held back
+// until the end of their frame, like those read from a device, and delivered a run of a device at a time.
+static void readReplay(InputDevices *devices) {
+	InputReplay *p = devices->replay;
+	InputRecordings *r = p->recordings;
+	int device = -1; // Whose events have been held since they were last delivered
+	int holding = 0;
+	uint64_t count;
+	if(p->stats.finished) return;
+	// Reset the timer, which has fired
+	if(read(p->timer_fd, &count, sizeof(count)) == -1) count = 0;
+	uint64_t now = monotonicNow();
+	for(int played = 0; played < REPLAY_BATCH; played++) {
+		if(!p->waiting) {
+			int status = readInputRecordings(r);
+			if((status == 1) && addReplayDevices(devices)) status = -1;
+			if(status != 1) {
+				finishReplay(devices, status ? (errno ? errno : EIO) : 0);
+				return;
+			}
+			p->waiting = 1;
+		}
+		int64_t time = (int64_t)r->evt.time.tv_sec * 1000000 + r->evt.time.tv_usec;
+		if(!p->started) {
+			p->started = 1;
+			p->start = now;
+			p->first = time;
+		}
+		// Events recorded out of order (from loopback) are played straight away
+		uint64_t due = ((p->speed > 0) && (time > p->first)) ? p->start + (uint64_t)((time - p->first) * 1000 / p->speed) : 0;
+		if(due > now) {
+			if(holding) playHeld(devices, device, 1);
+			armReplay(p, due);
+			return;
+		}
+		if(holding && (r->device != device)) playHeld(devices, device, 1);
+		device = r->device;
+		holding = 1;
+		holdEvent(devices, device, &r->evt);
+		p->waiting = 0;
+	}
+	if(holding) playHeld(devices, device, 1);
+	// More events are due: come back to them after anything else that's ready
+	armReplay(p, now);
+}
+
+// Only devices with events waiting (and regular files) are visited, however many there are
+static void serveEvents(InputDevices *devices, int wait) {
+	struct epoll_event ready[EPOLL_BATCH];
+	if(devices->num_always_ready) {
+		for(size_t dev = 0; dev < devices->num_devices; dev++) {
+			if(devices->devices[dev].always_ready) readDevice(devices, dev);
+		}
+		wait = 0;
+	}
+	int num = epoll_wait(devices->epoll_fd, ready, EPOLL_BATCH, wait ? -1 : 0);
+	for(int i = 0; i < num; i++) {
+		uint32_t id = ready[i].data.u32;
+		if(id == LOOPBACK_ID) {
+			readLoopback(devices);
+		} else if(id == HOTPLUG_ID) {
+			readHotplug(devices);
+		} else if(id == REPLAY_ID) {
+			readReplay(devices);
+		} else if(devices->devices[id].fd != -1) {
+			readDevice(devices, id);
 		}
 	}
 }
@@ -243,6 +988,7 @@ void getInputEvents(InputDevices *devices) {
 
 int serveInputEvents(InputDevices *devices) {
 	if(devices->serving != SV_IDLE) return 1;
+	if(!devices->loopback) return -1; // The server thread couldn't be stopped
 	devices->serving = SV_SERVING;
 	if(pthread_create(&devices->serverthread, NULL, (void *(*)(void *)) eventServerLoop, devices) != 0) {
 		devices->serving = SV_IDLE;
@@ -254,39 +1000,164 @@ int serveInputEvents(InputDevices *devices) {
 void stopServingInputEvents(InputDevices *devices) {
 	if(devices->serving != SV_SERVING) return;
 	devices->serving = SV_STOP;
-	InputEvent evt = {
-		.type = EV_KEY,
-		.code = KEY_EXIT,
-	};
-	loopbackEvent(devices, &evt);
-	pthread_join(devices->serverthread, NULL);
+	stopServer(devices);
 	devices->serving = SV_IDLE;
 }
 
-static void *doLoopbackEvent(void *arg) {
-	InputDevices *devices = ((void **)arg)[0];
-	const InputEvent *evt = ((void **)arg)[1];
-	ssize_t w = write(devices->loopback[1], evt, sizeof(InputEvent));
-	if(w == -1) {
-		devices->loopback[2] = errno;
+int filterInputEvents(InputDevices *devices, int dev, uint32_t types, int coalesce) {
+	if(dev == -1) {
+		devices->types = types;
+		devices->coalesce = coalesce;
+		for(size_t d = 0; d < devices->num_devices; d++) filterInputEvents(devices, d, types, coalesce);
+		return 0;
 	}
-	free(((void **)arg)[1]);
-	free(arg);
-	return NULL;
+	if((dev < 0) || ((size_t)dev >= devices->num_devices)) return -1;
+	InputDevice *d = &devices->devices[dev];
+	uint32_t old = d->types;
+	d->types = types;
+	d->coalesce = coalesce;
+	if((d->fd != -1) && (types != old)) maskDevice(d);
+	return 0;
 }
 
-void loopbackEvent(InputDevices *devices, const InputEvent *evt) {
-	InputEvent *e = malloc(sizeof(InputEvent));
-	void **arg = malloc(sizeof(void *) * 2);
-	if(!(arg && e)) {
-		free(e);
-		free(arg);
-		return;
+int setInputClock(InputDevices *devices, int clock) {
+	if((clock != CLOCK_REALTIME) && (clock != CLOCK_MONOTONIC) && (clock != CLOCK_BOOTTIME)) return -1;
+	devices->clock = clock;
+	for(size_t dev = 0; dev < devices->num_devices; dev++) {
+		// Fails for anything but evdev, which has no clock to set
+		if(devices->devices[dev].fd != -1) ioctl(devices->devices[dev].fd, EVIOCSCLOCKID, &clock);
 	}
-	*e = *evt;
-	arg[0] = devices;
-	arg[1] = e;
-	pthread_t t;
-	pthread_create(&t, NULL, doLoopbackEvent, arg);
-	pthread_detach(t);
+	return 0;
+}
+
+int trackInputState(InputDevices *devices) {
+	void *t;
+	if(devices->tracker) return 1;
+	if(devices->serving != SV_IDLE) return -1;
+	if(posix_memalign(&t, 64, sizeof(InputTracker))) return -1;
+	memset(t, 0, sizeof(InputTracker));
+	devices->tracker = t;
+	for(int slot = 0; slot < INPUT_MT_SLOTS; slot++) devices->tracker->state.touches[slot].id = -1;
+	for(size_t dev = 0; dev < devices->num_devices; dev++) {
+		if(devices->devices[dev].fd != -1) seedState(devices->tracker, &devices->devices[dev]);
+	}
+	return 0;
+}
+
+int getInputState(InputDevices *devices, InputState *state) {
+	InputTracker *t = devices->tracker;
+	uint32_t seq;
+	if(!t) return 1;
+	do {
+		// The thread changing the state may not be running, so don't spin waiting for it
+		while((seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+		memcpy(state, &t->state, sizeof(InputState));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(__atomic_load_n(&t->seq, __ATOMIC_RELAXED) != seq);
+	return 0;
+}
+
+int isKeyDown(const InputState *state, int code) {
+	return (code >= 0) && (code < KEY_CNT) && ((state->keys[code / 64] >> (code % 64)) & 1);
+}
+
+int replayInputRecordings(InputDevices *devices, const char **paths, size_t num_paths, double speed) {
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = REPLAY_ID,
+	};
+	if(devices->replay && !devices->replay->stats.finished) return 1;
+	if(devices->serving != SV_IDLE) return -1;
+	// A finished replay is only kept for its statistics
+	closeReplay(devices);
+	if(!(devices->replay = calloc(1, sizeof(InputReplay)))) return -1;
+	InputReplay *p = devices->replay;
+	p->speed = (speed > 0) ? speed : 0;
+	p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if((p->timer_fd == -1)
+		|| !(p->recordings = openInputRecordings(paths, num_paths))
+		|| (epoll_ctl(devices->epoll_fd, EPOLL_CTL_ADD, p->timer_fd, &ev) == -1)) {
+		closeReplay(devices);
+		return -1;
+	}
+	// Start as soon as events are served
+	armReplay(p, monotonicNow());
+	return 0;
+}
+
+int getInputReplayStats(InputDevices *devices, InputReplayStats *stats) {
+	InputReplay *p = devices->replay;
+	if(!p) return 1;
+	stats->finished = __atomic_load_n(&p->stats.finished, __ATOMIC_ACQUIRE);
+	stats->events = __atomic_load_n(&p->stats.events, __ATOMIC_RELAXED);
+	stats->error = p->stats.finished ? p->stats.error : 0;
+	return 0;
+}
+
+int queueInputEvents(InputDevices *devices, size_t capacity) {
+	void *q;
+	size_t size = 1;
+	if(devices->queue) return 1;
+	if(devices->serving != SV_IDLE) return -1;
+	while(size < capacity) size *= 2;
+	if(posix_memalign(&q, 64, sizeof(InputQueue) + size * sizeof(QueuedEvent))) return -1;
+	memset(q, 0, sizeof(InputQueue));
+	devices->queue = q;
+	devices->queue->capacity = size;
+	return 0;
+}
+
+size_t pullInputEvents(InputDevices *devices, QueuedEvent *evts, size_t max) {
+	InputQueue *q = devices->queue;
+	if(!q) return 0;
+	uint64_t head = q->head;
+	if(q->tail_seen - head < max) q->tail_seen = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	size_t num = (q->tail_seen - head < max) ? q->tail_seen - head : max;
+	// Copy in at most two parts: up to the end of the slots, then from the start
+	size_t first = q->capacity - (head & (q->capacity - 1));
+	if(first > num) first = num;
+	memcpy(evts, q->slots + (head & (q->capacity - 1)), first * sizeof(QueuedEvent));
+	memcpy(evts + first, q->slots, (num - first) * sizeof(QueuedEvent));
+	__atomic_store_n(&q->head, head + num, __ATOMIC_RELEASE);
+	return num;
+}
+
+int getInputQueueStats(InputDevices *devices, InputQueueStats *stats) {
+	InputQueue *q = devices->queue;
+	if(!q) return 1;
+	stats->queued = __atomic_load_n(&q->queued, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+	return 0;
+}
+
+size_t loopbackEvents(InputDevices *devices, const InputEvent *evts, size_t num) {
+	LoopbackRing *ring = devices->loopback;
+	uint64_t tail;
+	size_t reserved;
+	if(!ring) {
+		errno = devices->loopback_err ? devices->loopback_err : EBADF;
+		return 0;
+	}
+	do {
+		// head is read first, so tail - head can't be negative
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		size_t space = INPUT_LOOPBACK_EVENTS - (tail - head);
+		reserved = (num < space) ? num : space;
+		if(!reserved) {
+			errno = EAGAIN;
+			return 0;
+		}
+	} while(!__atomic_compare_exchange_n(&ring->tail, &tail, tail + reserved, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	for(size_t i = 0; i < reserved; i++) {
+		struct loopback_slot *slot = &ring->slots[(tail + i) % INPUT_LOOPBACK_EVENTS];
+		slot->evt = evts[i];
+		__atomic_store_n(&slot->seq, tail + i + 1, __ATOMIC_RELEASE);
+	}
+	wakeServer(devices);
+	return reserved;
+}
+
+int loopbackEvent(InputDevices *devices, const InputEvent *evt) {
+	return loopbackEvents(devices, evt, 1) ? 0 : -1;
 }
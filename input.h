@@ -20,31 +20,117 @@
 
 #include <linux/input.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
 typedef struct input_event InputEvent;
 
+// Queue of events sent with loopbackEvent(s), private to input.c
+typedef struct loopback_ring LoopbackRing;
+// Most loopback events waiting to be delivered
+#define INPUT_LOOPBACK_EVENTS 1024
+// Queue of events waiting for pullInputEvents, private to input.c
+typedef struct input_queue InputQueue;
+
+// An event taken from the queue, with the device it came from
+typedef struct queued_event {
+	InputEvent evt; // Its time is the kernel's timestamp
+	int device; // Index in InputDevices.devices, or -1 for loopback events
+} QueuedEvent;
+
+// Multitouch slots kept in InputState
+#define INPUT_MT_SLOTS 16
+
+// What is held down and pointed at, over every device
+typedef struct input_state {
+	uint64_t changes; // Number of times the state has changed
+	struct timeval time; // Kernel timestamp of the latest event
+	uint64_t keys[(KEY_CNT + 63) / 64]; // Bit k % 64 of keys[k / 64] is set while key or button k is down, see isKeyDown
+	int64_t rel[REL_CNT]; // Total motion of each relative axis: the difference from an earlier state is the motion since
+	int32_t abs[ABS_CNT]; // Latest value of each absolute axis
+	struct input_touch {
+		int32_t id; // Tracking id, -1 while nothing touches this slot
+		int32_t x, y;
+		int32_t pressure;
+	} touches[INPUT_MT_SLOTS];
+} InputState;
+
+// InputState shared with the thread serving events, private to input.c
+typedef struct input_tracker InputTracker;
+
+// Writes delivered events to a file, private to record.c
+typedef struct input_recorder InputRecorder;
+// Plays recordings back, private to input.c
+typedef struct input_replay InputReplay;
+
+typedef struct input_replay_stats {
+	uint64_t events; // Events played so far
+	int finished; // Set once every recording has been played
+	int error; // An error code if a recording couldn't be read
+} InputReplayStats;
+
+typedef struct input_queue_stats {
+	uint64_t queued; // Events added to the queue
+	uint64_t dropped; // Events lost because the queue was full, a frame at a time
+} InputQueueStats;
+
 typedef struct input_device {
 	char *name;
 	int fd;
 	int err;
+	uint32_t types; // Bit t is set if events of type t are delivered (EV_SYN always is), see filterInputEvents
+	int coalesce; // Merge motion, see filterInputEvents
+	// The rest is private
+	int mt_slot; // The multitouch slot that ABS_MT events change
+	int frame_kept; // Events of the current frame have already been delivered
+	int always_ready; // A regular file (saved events), which epoll can't watch: it is read on every wakeup
+	InputEvent *buffer; // Events read but not yet delivered
+	size_t buffered; // Bytes in buffer
 } InputDevice;
 
-// Maximum number of input devices
-#define MAX_INPUT_DEVICES 32
-
 typedef struct input_devices {
 	volatile int serving;
 	pthread_t serverthread;
-	InputDevice devices[MAX_INPUT_DEVICES];
-	int loopback[2]; // loopback[0] is the read end, loopback[1] is the write end, loopback[2] is an error code
+	InputDevice *devices; // num_devices of them, one for each path and then one for each device plugged in since
+	size_t num_devices;
+	size_t max_devices; // Room in devices
+	InputDevice **old_tables; // Tables replaced by a bigger one while serving, kept until close for threads still reading them
+	size_t num_old_tables;
+	int hotplug_fd; // An inotify instance watching hotplug_dir, -1 unless watching for devices
+	char *hotplug_dir;
+	int epoll_fd; // Every open device and the loopback are registered with this
+	size_t num_always_ready; // Open devices that are regular files rather than registered
+	LoopbackRing *loopback;
+	int loopback_fd; // An eventfd signalled when loopback events are sent
+	int loopback_err; // An error code from the loopback
 	void (*callback)(const InputEvent *evt, const InputDevice *dev, void *data);
+	// If set, called instead of callback with each frame of events: up to and including a SYN_REPORT
+	void (*frame_callback)(const InputEvent *evts, size_t num, const InputDevice *dev, void *data);
+	// If set while watching for devices (or replaying), called when a device is opened (added is 1) or closed because it went away (added is 0)
+	void (*hotplug_callback)(const InputDevice *dev, int added, void *data);
 	void *callback_data;
+	uint32_t types; // Given to devices opened from now on, see filterInputEvents
+	int coalesce;
+	int clock; // Clock of event timestamps for devices opened from now on, see setInputClock
+	InputTracker *tracker; // NULL unless keeping an InputState
+	InputRecorder *recorder; // NULL unless recording events, see record.h
+	InputReplay *replay; // NULL unless playing recordings
+	InputQueue *queue; // NULL unless events are queued for pullInputEvents instead of calling callbacks
 } InputDevices;
 
-// Default path of input devices: device number is added at the end
+// Values of InputDevices.serving
+#define SV_IDLE 0
+#define SV_SERVING 1
+#define SV_RESCAN 2
+#define SV_RESCANP 3
+#define SV_STOP -1
+
+// Every type of event
+#define INPUT_ALL_TYPES 0xffffffff
+
+// Default input devices: every file in INPUT_DIR whose name starts with "event"
+#define INPUT_DIR "/dev/input"
 #define INPUT_PATH "/dev/input/event"
-#define INPUT_PATH_LEN 19
 
 // Open all input devices: paths variant allows defining custom paths
 // It is safe to free paths after calling this function (paths are copied)
@@ -61,6 +147,26 @@ int closeInputDevices(InputDevices *devices);
 int rescanInputDevices(InputDevices *devices);
 int rescanInputDevicesPaths(InputDevices *devices, const char **paths, size_t num_paths);
 
+// Watch dir (INPUT_DIR if NULL) for event devices being plugged in and removed, from the thread serving events:
+// new ones are opened and added to the end of the table, removed ones are closed and left in place with err set to ENODEV,
+// and a device that comes back with the same name is reopened in its old place. Devices in dir that aren't open yet are opened now.
+// Call this while not serving events. Returns 0 on success, 1 if already watching, -1 on failure.
+int watchInputDevices(InputDevices *devices, const char *dir);
+
+// Deliver only events whose type has its bit set in types (1 << EV_KEY and so on, EV_SYN is always delivered)
+// from device dev, or from every device (including those opened later) if dev is -1.
+// The kernel drops the other events where it supports EVIOCSMASK, otherwise they are dropped after reading.
+// Frames left with no events aren't delivered.
+// If coalesce is set, frames with only relative and absolute (not multitouch) motion that arrive together are merged into one:
+// relative axes are added up and absolute axes take their latest value, so slow consumers get one frame instead of many.
+// Call this while not serving events or from a callback. Returns 0 on success, -1 if dev doesn't exist.
+int filterInputEvents(InputDevices *devices, int dev, uint32_t types, int coalesce);
+
+// Have devices (including those opened later) timestamp events with clock: CLOCK_REALTIME (the default), CLOCK_MONOTONIC or CLOCK_BOOTTIME.
+// CLOCK_MONOTONIC makes timestamps comparable with clock_gettime, for measuring latency (see latency.h).
+// Devices that aren't evdev (saved events and pipes) keep their timestamps. Returns 0 on success, -1 if the clock isn't supported.
+int setInputClock(InputDevices *devices, int clock);
+
 // The registered callback for devices is called for each available event
 // If you use this method be sure to call it regularly
 void getInputEvents(InputDevices *devices);
@@ -69,12 +175,44 @@ void getInputEvents(InputDevices *devices);
 // This is the preferred method of obtaining input
 int serveInputEvents(InputDevices *devices);
 
-// IMPORTANT: Don't forget to set callback before calling get/serveInputEvents
+// IMPORTANT: Don't forget to set callback (or frame_callback) before calling get/serveInputEvents
 
 // You probably shouldn't call this without calling serveInputEvents first
 void stopServingInputEvents(InputDevices *devices);
 
-// Send an event to ourself
-void loopbackEvent(InputDevices *devices, const InputEvent *evt);
+// Queue events for pullInputEvents rather than calling callbacks: whole frames (up to and including a SYN_REPORT) of
+// events are added to a queue of capacity events (rounded up to a power of 2) without blocking, or dropped if they don't fit.
+// Call this while not serving events. Returns 0 on success, 1 if already queueing, -1 on failure.
+int queueInputEvents(InputDevices *devices, size_t capacity);
+// Take up to max events from the queue in the order they arrived, without blocking. Returns how many were taken.
+// Only one thread may pull events, which can be a different one from the thread serving them.
+size_t pullInputEvents(InputDevices *devices, QueuedEvent *evts, size_t max);
+// Returns non-zero if events aren't being queued
+int getInputQueueStats(InputDevices *devices, InputQueueStats *stats);
+
+// Keep an InputState up to date as events are delivered, starting from what open devices report is held down and where their axes are
+// (devices opened later are added in the same way). Call this while not serving events.
+// Returns 0 on success, 1 if already keeping state, -1 on failure.
+int trackInputState(InputDevices *devices);
+// Copy a consistent InputState, from any thread. Never blocks the thread serving events, which changes the state a batch of events at a time.
+// Returns non-zero if the state isn't being kept.
+int getInputState(InputDevices *devices, InputState *state);
+int isKeyDown(const InputState *state, int code);
+
+// Play recordings (see record.h) back, merged in order of their timestamps, from the thread serving events (or getInputEvents).
+// Each recorded device is added to the end of the table when its first event is due, and closed at the end as though unplugged:
+// its events are delivered as though read from it, timestamps included, speed times as fast as they were recorded,
+// or as fast as possible if speed is 0. Call this while not serving events, and don't rescan while replaying.
+// Once finished the recordings are closed, and another replay can be started. Returns 0 on success, 1 if still replaying, -1 on failure.
+int replayInputRecordings(InputDevices *devices, const char **paths, size_t num_paths, double speed);
+// Safe to call from any thread. Returns non-zero if not replaying.
+int getInputReplayStats(InputDevices *devices, InputReplayStats *stats);
+
+// Send an event to ourself: it is delivered with a NULL device. Safe to call from any thread, including from callbacks.
+// With frame_callback or the queue, loopback events are held back until a SYN_REPORT is sent, like events from a device.
+// Never blocks: returns 0 on success, or -1 with errno set to EAGAIN if INPUT_LOOPBACK_EVENTS events are already waiting.
+int loopbackEvent(InputDevices *devices, const InputEvent *evt);
+// Send up to num events at once, returns how many were sent (fewer if the loopback fills up)
+size_t loopbackEvents(InputDevices *devices, const InputEvent *evts, size_t num);
 
 #endif /* INPUT_H */
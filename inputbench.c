@@ -0,0 +1,273 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures how fast events get through input.h, using FIFOs as devices so no root or uinput is needed.
+// A producer thread writes frames of events at a given rate to the FIFOs, which are served by calling getInputEvents in a loop or by
+// serveInputEvents, or sends them with loopbackEvents to serveInputEvents.
+// Prints one JSON object per line for each combination of mode, device count and rate.
+// Linked with --wrap for read, write and epoll_wait so that it can count the system calls made.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+#include "input.h"
+
+#define MODE_POLL 0 // getInputEvents in a loop
+#define MODE_SERVE 1 // serveInputEvents
+#define MODE_LOOPBACK 2 // loopbackEvents, served by serveInputEvents
+static const char *modes[] = {"poll", "serve", "loopback"};
+
+// Most events in a frame, including its SYN_REPORT
+#define MAX_FRAME 64
+
+typedef struct bench {
+	int mode;
+	int numDevices;
+	double rate; // Events per second, 0 for as fast as possible
+	int frameEvents;
+	size_t frames;
+	InputDevices *devices;
+	int *fds; // Write ends of the FIFOs
+	double *sent; // When each frame was sent
+	double *latency; // From being sent to its frame_callback
+	size_t received; // Frames delivered so far
+	double end; // When the last one was
+} Bench;
+
+// System calls counted by the wrappers below, for the producer and everything else
+static __thread int producer;
+static uint64_t producerCalls, consumerCalls;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real___read_chk(int fd, void *buf, size_t count, size_t size);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+static void countCall(void) {
+	__atomic_fetch_add(producer ? &producerCalls : &consumerCalls, 1, __ATOMIC_RELAXED);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+	countCall();
+	return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap___read_chk(int fd, void *buf, size_t count, size_t size) {
+	countCall();
+	return __real___read_chk(fd, buf, count, size);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+	countCall();
+	return __real_write(fd, buf, count);
+}
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+	countCall();
+	return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// The first event of each frame holds its number
+static void frameCallback(const InputEvent *evts, size_t num, const InputDevice *dev, void *data) {
+	(void)dev;
+	Bench *b = data;
+	double t = now();
+	if((evts[0].type != EV_REL) || (evts[num - 1].type != EV_SYN)) return; // KEY_EXIT from stopping
+	size_t frame = evts[0].value;
+	b->latency[frame] = t - b->sent[frame];
+	b->end = t;
+	__atomic_store_n(&b->received, b->received + 1, __ATOMIC_RELEASE);
+}
+
+static void *produce(Bench *b) {
+	InputEvent evts[MAX_FRAME];
+	double start = now();
+	producer = 1;
+	memset(evts, 0, sizeof(evts));
+	for(int i = 0; i < b->frameEvents - 1; i++) {
+		evts[i].type = EV_REL;
+		evts[i].code = i % 2 ? REL_Y : REL_X;
+		evts[i].value = 1;
+	}
+	evts[b->frameEvents - 1].type = EV_SYN;
+	for(size_t frame = 0; frame < b->frames; frame++) {
+		if(b->rate > 0) {
+			double due = start + frame * b->frameEvents / b->rate;
+			double wait = due - now();
+			if(wait > 0) {
+				struct timespec ts = {wait, (wait - (long)wait) * 1e9};
+				nanosleep(&ts, NULL);
+			}
+		}
+		evts[0].value = frame;
+		b->sent[frame] = now();
+		if(b->mode == MODE_LOOPBACK) {
+			size_t done = 0;
+			while((done += loopbackEvents(b->devices, evts + done, b->frameEvents - done)) < (size_t)b->frameEvents) sched_yield();
+		} else if(write(b->fds[frame % b->numDevices], evts, b->frameEvents * sizeof(InputEvent)) == -1) {
+			perror("write");
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+// Make numDevices FIFOs in dir and open them as devices, keeping their write ends in b->fds
+static void openFIFOs(Bench *b, const char *dir) {
+	const char **paths = malloc(b->numDevices * sizeof(char *));
+	int *readers = malloc(b->numDevices * sizeof(int));
+	if(!paths || !readers || !(b->fds = malloc(b->numDevices * sizeof(int)))) exit(1);
+	for(int d = 0; d < b->numDevices; d++) {
+		char *path = malloc(strlen(dir) + 32);
+		if(!path) exit(1);
+		sprintf(path, "%s/event%d", dir, d);
+		paths[d] = path;
+		// Open for reading first so that opening for writing doesn't block
+		if((mkfifo(path, 0600) == -1) || ((readers[d] = open(path, O_RDONLY | O_NONBLOCK)) == -1) || ((b->fds[d] = open(path, O_WRONLY)) == -1)) {
+			perror(path);
+			exit(1);
+		}
+	}
+	if(!(b->devices = openInputDevicesPaths(paths, b->numDevices))) exit(1);
+	for(int d = 0; d < b->numDevices; d++) {
+		if(b->devices->devices[d].err) {
+			fprintf(stderr, "%s: %s\n", paths[d], strerror(b->devices->devices[d].err));
+			exit(1);
+		}
+		close(readers[d]);
+		unlink(paths[d]);
+		free((char *)paths[d]);
+	}
+	free(paths);
+	free(readers);
+}
+
+static void run(int mode, int numDevices, double rate, int frameEvents, size_t events, const char *dir) {
+	Bench b = {
+		.mode = mode,
+		.numDevices = numDevices,
+		.rate = rate,
+		.frameEvents = frameEvents,
+		.frames = (events + frameEvents - 1) / frameEvents,
+	};
+	pthread_t thread;
+	if(!(b.sent = malloc(b.frames * sizeof(double))) || !(b.latency = malloc(b.frames * sizeof(double)))) exit(1);
+	if(mode == MODE_LOOPBACK) {
+		if(!(b.devices = openInputDevicesPaths(NULL, 0))) exit(1);
+	} else {
+		openFIFOs(&b, dir);
+	}
+	b.devices->frame_callback = frameCallback;
+	b.devices->callback_data = &b;
+	if((mode != MODE_POLL) && serveInputEvents(b.devices)) exit(1);
+	producerCalls = consumerCalls = 0;
+	double start = now();
+	if(pthread_create(&thread, NULL, (void *(*)(void *)) produce, &b)) exit(1);
+	while(__atomic_load_n(&b.received, __ATOMIC_ACQUIRE) < b.frames) {
+		if(mode == MODE_POLL) {
+			getInputEvents(b.devices);
+		} else {
+			usleep(1000);
+		}
+	}
+	pthread_join(thread, NULL);
+	// Stopping isn't part of it
+	uint64_t consumer = __atomic_load_n(&consumerCalls, __ATOMIC_RELAXED);
+	uint64_t produced = __atomic_load_n(&producerCalls, __ATOMIC_RELAXED);
+	if(mode != MODE_POLL) stopServingInputEvents(b.devices);
+	closeInputDevices(b.devices);
+	for(int d = 0; (mode != MODE_LOOPBACK) && (d < numDevices); d++) close(b.fds[d]);
+	size_t n = b.frames * frameEvents;
+	double total = b.end - start;
+	qsort(b.latency, b.frames, sizeof(double), compareDoubles);
+	printf("{\"mode\": \"%s\", \"devices\": %d, \"rate\": %.0f, \"frame_events\": %d, \"events\": %zu, \"events_per_s\": %.0f, "
+		"\"syscalls_per_event\": %.3f, \"producer_syscalls_per_event\": %.3f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}\n",
+		modes[mode], (mode == MODE_LOOPBACK) ? 0 : numDevices, rate, frameEvents, n, n / total,
+		(double)consumer / n, (double)produced / n,
+		b.latency[b.frames / 2] * 1e6, b.latency[(b.frames * 99) / 100] * 1e6, b.latency[(b.frames * 999) / 1000] * 1e6, b.latency[b.frames - 1] * 1e6);
+	fflush(stdout);
+	free(b.fds);
+	free(b.sent);
+	free(b.latency);
+}
+
+int main(int argc, char **argv) {
+	static const int deviceCounts[] = {1, 16, 128};
+	static const double rates[] = {0, 100000};
+	int numDevices = 0, frameEvents = 3, only = -1;
+	double rate = -1;
+	size_t events = 300000;
+	char dir[] = "/tmp/inputbench.XXXXXX";
+	int opt;
+	while((opt = getopt(argc, argv, "d:r:f:n:m:")) != -1) {
+		switch(opt) {
+		case 'd': numDevices = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'f': frameEvents = atoi(optarg); break;
+		case 'n': events = atol(optarg); break;
+		case 'm':
+			for(int m = MODE_POLL; m <= MODE_LOOPBACK; m++) {
+				if(!strcmp(optarg, modes[m])) only = m;
+			}
+			if(only == -1) goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if((numDevices < 0) || (frameEvents < 2) || (frameEvents > MAX_FRAME) || (events < 1)) goto usage;
+	if(!mkdtemp(dir)) {
+		perror(dir);
+		return 1;
+	}
+	for(int m = MODE_POLL; m <= MODE_LOOPBACK; m++) {
+		if((only != -1) && (m != only)) continue;
+		for(size_t r = 0; r < sizeof(rates) / sizeof(double); r++) {
+			if((rate >= 0) && r) break;
+			for(size_t d = 0; d < sizeof(deviceCounts) / sizeof(int); d++) {
+				// Loopback events don't come from devices
+				if((numDevices || (m == MODE_LOOPBACK)) && d) break;
+				run(m, numDevices ? numDevices : deviceCounts[d], (rate >= 0) ? rate : rates[r], frameEvents, events, dir);
+			}
+		}
+	}
+	rmdir(dir);
+	return 0;
+usage:
+	fprintf(stderr, "Usage: %s [-m poll|serve|loopback] [-d devices] [-r events per second, 0 for unlimited] [-f events per frame] [-n events]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,180 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "latency.h"
+
+#define TRY(predicate) if(!(predicate)) goto fail
+
+// The oldest input a frame responds to
+typedef struct latencyTag {
+	int set;
+	uint64_t event; // Its timestamp
+	uint64_t tagged; // When the frame was tagged with it
+} LatencyTag;
+
+struct latencyTrace {
+	pthread_mutex_t lock; // Frames are tagged, submitted and presented on different threads while the application reads statistics
+	LatencyTag drawing; // Of the frame being drawn
+	LatencyTag submitted; // Of the frame waiting to be presented asynchronously
+	LatencyTag presenting; // Of the frame the present thread is swapping
+	LatencyStats stats;
+};
+
+static uint64_t monotonicNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keep the older of two tags in to
+static void mergeTag(LatencyTag *to, const LatencyTag *from) {
+	if(from->set && (!to->set || (from->event < to->event))) *to = *from;
+}
+
+static int bucket(uint64_t ns) {
+	int b = 0;
+	for(uint64_t us = ns / 1000; (us > 1) && (b < FB_LATENCY_BUCKETS - 1); us >>= 1) b++;
+	return b;
+}
+
+int startLatencyTraceFBDev(FrameBufferDevice *fbd) {
+	assert(fbd);
+	if(fbd->latency) return 1;
+	LatencyTrace *t;
+	errno = EINVAL;
+	TRY(!fbd->async);
+	TRY(t = calloc(1, sizeof(LatencyTrace)));
+	pthread_mutex_init(&t->lock, NULL);
+	fbd->latency = t;
+	return 0;
+fail:
+	perror("startLatencyTraceFBDev");
+	return -1;
+}
+
+void stopLatencyTraceFBDev(FrameBufferDevice *fbd) {
+	assert(fbd);
+	LatencyTrace *t = fbd->latency;
+	if(!t) return;
+	fbd->latency = NULL;
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+void tagFrameFBDev(FrameBufferDevice *fbd, const struct timeval *time) {
+	assert(fbd && time);
+	LatencyTrace *t = fbd->latency;
+	if(!t) return;
+	LatencyTag tag = {
+		.set = 1,
+		.event = (uint64_t)time->tv_sec * 1000000000 + (uint64_t)time->tv_usec * 1000,
+		.tagged = monotonicNs(),
+	};
+	pthread_mutex_lock(&t->lock);
+	mergeTag(&t->drawing, &tag);
+	pthread_mutex_unlock(&t->lock);
+}
+
+void latencySubmit(FrameBufferDevice *fbd) {
+	LatencyTrace *t = fbd->latency;
+	pthread_mutex_lock(&t->lock);
+	// A frame still waiting is replaced, and what it responded to is shown by this one instead
+	mergeTag(&t->submitted, &t->drawing);
+	t->drawing.set = 0;
+	pthread_mutex_unlock(&t->lock);
+}
+
+void latencyTake(FrameBufferDevice *fbd) {
+	LatencyTrace *t = fbd->latency;
+	pthread_mutex_lock(&t->lock);
+	t->presenting = t->submitted;
+	t->submitted.set = 0;
+	pthread_mutex_unlock(&t->lock);
+}
+
+void latencySwap(FrameBufferDevice *fbd, uint64_t start, uint64_t shown) {
+	LatencyTrace *t = fbd->latency;
+	LatencyStats *s = &t->stats;
+	pthread_mutex_lock(&t->lock);
+	LatencyTag *tag = fbd->async ? &t->presenting : &t->drawing;
+	if(!tag->set) {
+		pthread_mutex_unlock(&t->lock);
+		return;
+	}
+	tag->set = 0;
+	if((tag->event > tag->tagged) || (tag->tagged > start)) {
+		s->skewed++;
+		pthread_mutex_unlock(&t->lock);
+		return;
+	}
+	uint64_t times[FB_LATENCY_STAGES];
+	times[FB_LATENCY_DISPATCH] = tag->tagged - tag->event;
+	times[FB_LATENCY_APP] = start - tag->tagged;
+	times[FB_LATENCY_SWAP] = shown - start;
+	times[FB_LATENCY_TOTAL] = shown - tag->event;
+	for(int stage = 0; stage < FB_LATENCY_STAGES; stage++) {
+		s->sum[stage] += times[stage];
+		if(times[stage] > s->max[stage]) s->max[stage] = times[stage];
+		s->histograms[stage][bucket(times[stage])]++;
+	}
+	s->frames++;
+	pthread_mutex_unlock(&t->lock);
+}
+
+int getLatencyStatsFBDev(FrameBufferDevice *fbd, LatencyStats *stats) {
+	assert(fbd && stats);
+	LatencyTrace *t = fbd->latency;
+	if(!t) return 1;
+	pthread_mutex_lock(&t->lock);
+	*stats = t->stats;
+	pthread_mutex_unlock(&t->lock);
+	return 0;
+}
+
+uint64_t latencyPercentileFBDev(const uint64_t *histogram, double p) {
+	uint64_t count = 0, seen = 0;
+	for(int b = 0; b < FB_LATENCY_BUCKETS; b++) count += histogram[b];
+	for(int b = 0; b < FB_LATENCY_BUCKETS; b++) {
+		seen += histogram[b];
+		if(histogram[b] && (seen >= p * count)) return (uint64_t)2 << b;
+	}
+	return 0;
+}
+
+void dumpLatencyFBDev(FrameBufferDevice *fbd, FILE *f) {
+	assert(fbd && f);
+	static const char *stages[FB_LATENCY_STAGES] = {"dispatch", "app", "swap", "total"};
+	LatencyStats s;
+	if(getLatencyStatsFBDev(fbd, &s)) return;
+	uint64_t n = s.frames ? s.frames : 1;
+	fprintf(f, "{\"frames\": %llu, \"skewed\": %llu", (unsigned long long)s.frames, (unsigned long long)s.skewed);
+	for(int stage = 0; stage < FB_LATENCY_STAGES; stage++) {
+		fprintf(f, ", \"%s\": {\"mean_us\": %.1f, \"p50_us\": %llu, \"p99_us\": %llu, \"max_us\": %.1f, \"histogram\": [", stages[stage],
+			s.sum[stage] / 1e3 / n, (unsigned long long)latencyPercentileFBDev(s.histograms[stage], 0.5),
+			(unsigned long long)latencyPercentileFBDev(s.histograms[stage], 0.99), s.max[stage] / 1e3);
+		for(int b = 0; b < FB_LATENCY_BUCKETS; b++) fprintf(f, b ? ", %llu" : "%llu", (unsigned long long)s.histograms[stage][b]);
+		fprintf(f, "]}");
+	}
+	fprintf(f, "}\n");
+}
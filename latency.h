@@ -0,0 +1,66 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "fb.h"
+
+// Stages of the time from an input event to the frame responding to it being on screen
+#define FB_LATENCY_DISPATCH 0 // From the event's timestamp until the application tagged a frame with it
+#define FB_LATENCY_APP 1 // From tagging until the swap presenting the frame started
+#define FB_LATENCY_SWAP 2 // From then until the frame was on screen
+#define FB_LATENCY_TOTAL 3 // From the event's timestamp until the frame was on screen
+#define FB_LATENCY_STAGES 4
+
+// Histogram bucket b counts times in [2^b, 2^(b + 1)) microseconds: the first also counts anything shorter, the last anything longer
+#define FB_LATENCY_BUCKETS 24
+
+typedef struct latencyStats {
+	uint64_t frames; // Frames presented that were tagged with input
+	uint64_t skewed; // Tags with timestamps ahead of CLOCK_MONOTONIC (from another clock), which aren't counted
+	uint64_t sum[FB_LATENCY_STAGES]; // Nanoseconds, over the frames
+	uint64_t max[FB_LATENCY_STAGES];
+	uint64_t histograms[FB_LATENCY_STAGES][FB_LATENCY_BUCKETS];
+} LatencyStats;
+
+// Measure input-to-photon latency of frames tagged with tagFrameFBDev. Input timestamps must come from CLOCK_MONOTONIC:
+// call setInputClock(devices, CLOCK_MONOTONIC) (see input.h) first. Start and stop tracing while not presenting asynchronously.
+// Returns 0 on success, 1 if already tracing, -1 on failure.
+int startLatencyTraceFBDev(FrameBufferDevice *fbd);
+void stopLatencyTraceFBDev(FrameBufferDevice *fbd); // Called by close
+// Tag the frame being drawn with the timestamp of an input event it responds to, from the thread drawing frames.
+// The frame keeps the oldest of its tags, which the swap presenting it (or the submitted frame, and any that replaces it) takes.
+void tagFrameFBDev(FrameBufferDevice *fbd, const struct timeval *time);
+// Copy the statistics so far into stats, from any thread. Returns non-zero if not tracing.
+int getLatencyStatsFBDev(FrameBufferDevice *fbd, LatencyStats *stats);
+// Microseconds below which fraction p (0 to 1) of the times counted by histogram fall
+uint64_t latencyPercentileFBDev(const uint64_t *histogram, double p);
+// Write the statistics to f as one line of JSON, histograms included
+void dumpLatencyFBDev(FrameBufferDevice *fbd, FILE *f);
+
+// Called by fb.c with the present queue locked, when a frame is submitted and when the present thread takes it
+void latencySubmit(FrameBufferDevice *fbd);
+void latencyTake(FrameBufferDevice *fbd);
+// Called by swap once the frame is on screen, with the CLOCK_MONOTONIC times in nanoseconds the swap started and the frame was shown
+void latencySwap(FrameBufferDevice *fbd, uint64_t start, uint64_t shown);
+
+#endif /* LATENCY_H */
@@ -0,0 +1,209 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "multihead.h"
+
+#define TRY(predicate) if(!(predicate)) goto fail
+
+typedef struct headThread {
+	pthread_t thread;
+	int index;
+	MultiHead *mh;
+} HeadThread;
+
+static void *headLoop(HeadThread *t) {
+	MultiHead *mh = t->mh;
+	FrameBufferDevice *fbd = mh->heads[t->index];
+	uint64_t seen = 0;
+	pthread_mutex_lock(&mh->lock);
+	for(;;) {
+		while(mh->running && (mh->generation == seen)) pthread_cond_wait(&mh->start, &mh->lock);
+		if(!mh->running) break;
+		seen = mh->generation;
+		pthread_mutex_unlock(&mh->lock);
+		size_t written = fbd->swap(fbd);
+		pthread_mutex_lock(&mh->lock);
+		mh->written += written;
+		if(!--mh->remaining) pthread_cond_signal(&mh->finished);
+	}
+	pthread_mutex_unlock(&mh->lock);
+	return NULL;
+}
+
+static void stopThreads(MultiHead *mh, int numThreads) {
+	pthread_mutex_lock(&mh->lock);
+	mh->running = 0;
+	pthread_cond_broadcast(&mh->start);
+	pthread_mutex_unlock(&mh->lock);
+	for(int k = 1; k < numThreads; k++) pthread_join(mh->threads[k].thread, NULL);
+}
+
+static Pixel *allocFrame(size_t size) {
+	void *frame;
+	if((errno = posix_memalign(&frame, 64, size))) return NULL;
+	return memset(frame, 0, size);
+}
+
+// Lay the heads out in shared frames and point their own frames into them
+static int span(MultiHead *mh) {
+	for(int k = 0; k < mh->numHeads; k++) {
+		FrameBufferDevice *fbd = mh->heads[k];
+		mh->headX[k] = (mh->layout == FB_HEADS_SPAN_X) ? mh->xres : 0;
+		mh->headY[k] = (mh->layout == FB_HEADS_SPAN_Y) ? mh->yres : 0;
+		if(mh->layout == FB_HEADS_SPAN_X) {
+			mh->xres += fbd->xres;
+			if(fbd->yres > mh->yres) mh->yres = fbd->yres;
+		} else {
+			mh->yres += fbd->yres;
+			if(fbd->xres > mh->xres) mh->xres = fbd->xres;
+		}
+	}
+	size_t frameSize = (size_t)mh->xres * mh->yres * sizeof(Pixel);
+	TRY(mh->nextFrame = allocFrame(frameSize));
+	TRY(mh->lastFrame = allocFrame(frameSize));
+	for(int k = 0; k < mh->numHeads; k++) {
+		FrameBufferDevice *fbd = mh->heads[k];
+		size_t offset = (size_t)mh->headY[k] * mh->xres + mh->headX[k];
+		free(fbd->nextFrame);
+		free(fbd->lastFrame);
+		fbd->nextFrame = mh->nextFrame + offset;
+		fbd->lastFrame = mh->lastFrame + offset;
+		fbd->pitch = mh->xres;
+		fbd->spanned = 1;
+		fbd->fullDamage = 1;
+	}
+	return 0;
+fail:
+	return 1;
+}
+
+MultiHead *newMultiHead(FrameBufferDevice **heads, int numHeads, int layout) {
+	MultiHead *mh = NULL;
+	int started = 0;
+	errno = EINVAL;
+	TRY((numHeads > 0) && (layout >= FB_HEADS_SEPARATE) && (layout <= FB_HEADS_SPAN_Y));
+	TRY(mh = calloc(1, sizeof(MultiHead)));
+	mh->numHeads = numHeads;
+	mh->layout = layout;
+	TRY(mh->heads = malloc(numHeads * sizeof(FrameBufferDevice *)));
+	memcpy(mh->heads, heads, numHeads * sizeof(FrameBufferDevice *));
+	TRY(mh->headX = calloc(numHeads, sizeof(int)));
+	TRY(mh->headY = calloc(numHeads, sizeof(int)));
+	TRY(mh->threads = calloc(numHeads, sizeof(HeadThread)));
+	pthread_mutex_init(&mh->lock, NULL);
+	pthread_cond_init(&mh->start, NULL);
+	pthread_cond_init(&mh->finished, NULL);
+	mh->running = 1;
+	for(started = 1; started < numHeads; started++) {
+		HeadThread *t = &mh->threads[started];
+		t->index = started;
+		t->mh = mh;
+		TRY(pthread_create(&t->thread, NULL, (void *(*)(void *)) headLoop, t) == 0);
+	}
+	// Spanning is set up last, as the heads' own frames are freed
+	if(layout != FB_HEADS_SEPARATE) TRY(!span(mh));
+	return mh;
+fail:
+	perror("newMultiHead");
+	if(mh) {
+		if(mh->threads) {
+			stopThreads(mh, started);
+			pthread_mutex_destroy(&mh->lock);
+			pthread_cond_destroy(&mh->start);
+			pthread_cond_destroy(&mh->finished);
+		}
+		free(mh->nextFrame);
+		free(mh->lastFrame);
+		free(mh->threads);
+		free(mh->headX);
+		free(mh->headY);
+		free(mh->heads);
+		free(mh);
+	}
+	return NULL;
+}
+
+MultiHead *openMultiHead(const char **paths, int numHeads, int layout) {
+	FrameBufferDevice **heads = NULL;
+	MultiHead *mh = NULL;
+	TRY(numHeads > 0);
+	TRY(heads = calloc(numHeads, sizeof(FrameBufferDevice *)));
+	for(int k = 0; k < numHeads; k++) TRY(heads[k] = openFBDev(paths[k]));
+	TRY(mh = newMultiHead(heads, numHeads, layout));
+	free(heads);
+	return mh;
+fail:
+	if(heads) {
+		for(int k = 0; k < numHeads; k++) {
+			if(heads[k]) heads[k]->close(heads[k]);
+		}
+	}
+	free(heads);
+	return NULL;
+}
+
+void closeMultiHead(MultiHead *mh) {
+	assert(mh);
+	stopThreads(mh, mh->numHeads);
+	pthread_mutex_destroy(&mh->lock);
+	pthread_cond_destroy(&mh->start);
+	pthread_cond_destroy(&mh->finished);
+	for(int k = 0; k < mh->numHeads; k++) {
+		mh->heads[k]->close(mh->heads[k]);
+	}
+	free(mh->nextFrame);
+	free(mh->lastFrame);
+	free(mh->threads);
+	free(mh->headX);
+	free(mh->headY);
+	free(mh->heads);
+	free(mh);
+}
+
+size_t swapMultiHead(MultiHead *mh) {
+	assert(mh);
+	pthread_mutex_lock(&mh->lock);
+	mh->written = 0;
+	mh->remaining = mh->numHeads - 1;
+	mh->generation++;
+	pthread_cond_broadcast(&mh->start);
+	pthread_mutex_unlock(&mh->lock);
+	size_t written = mh->heads[0]->swap(mh->heads[0]);
+	pthread_mutex_lock(&mh->lock);
+	while(mh->remaining) pthread_cond_wait(&mh->finished, &mh->lock);
+	written += mh->written;
+	pthread_mutex_unlock(&mh->lock);
+	// Every head switched its frames, which are parts of the shared ones
+	Pixel *tmp = mh->nextFrame;
+	mh->nextFrame = mh->lastFrame;
+	mh->lastFrame = tmp;
+	return written;
+}
+
+void damageMultiHead(MultiHead *mh, int x, int y, int w, int h) {
+	assert(mh);
+	if(mh->layout == FB_HEADS_SEPARATE) return;
+	// Each head clips the rectangle to its own frame
+	for(int k = 0; k < mh->numHeads; k++) mh->heads[k]->damage(mh->heads[k], x - mh->headX[k], y - mh->headY[k], w, h);
+}
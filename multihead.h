@@ -0,0 +1,65 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MULTIHEAD_H
+#define MULTIHEAD_H 1
+
+#include "fb.h"
+
+// Layouts: separate heads each keep their own frames,
+// spanning heads share one frame with the heads side by side from left to right, or stacked from top to bottom
+#define FB_HEADS_SEPARATE 0
+#define FB_HEADS_SPAN_X 1
+#define FB_HEADS_SPAN_Y 2
+
+// Several framebuffers presented together, each by its own thread
+typedef struct multiHead {
+	int numHeads;
+	FrameBufferDevice **heads;
+	int layout;
+	// Only for spanning layouts: the shared frames, xres by yres, with head k's frames at (headX[k], headY[k]) in them
+	int xres, yres;
+	Pixel *nextFrame;
+	Pixel *lastFrame;
+	int *headX, *headY;
+	// The rest is private
+	struct headThread *threads; // threads[0] is unused: head 0 is swapped by the caller
+	pthread_mutex_t lock;
+	pthread_cond_t start; // Signalled when generation changes or the threads should stop
+	pthread_cond_t finished; // Signalled when remaining reaches 0
+	int running;
+	uint64_t generation;
+	int remaining;
+	size_t written;
+} MultiHead;
+
+// Open the numHeads framebuffers at paths. The console is switched to graphics mode once for all of them.
+// Returns NULL on failure.
+MultiHead *openMultiHead(const char **paths, int numHeads, int layout);
+// Present already open devices together: they belong to the MultiHead on success, and are left alone on failure.
+// Set up scaling or rotation on heads first: spanning heads are marked spanned and can't be scaled, rotated or presented asynchronously afterwards.
+// Only swap spanning heads through swapMultiHead: their own swap would switch their frames without the shared ones.
+MultiHead *newMultiHead(FrameBufferDevice **heads, int numHeads, int layout);
+void closeMultiHead(MultiHead *mh); // Also closes the heads
+
+// Swap every head at once, so the call takes as long as the slowest head rather than all of them.
+// With a spanning layout nextFrame and lastFrame are switched too. Returns the number of bytes written to all heads.
+size_t swapMultiHead(MultiHead *mh);
+// Mark a rectangle of the shared frame as changed on the heads it covers (spanning layouts only)
+void damageMultiHead(MultiHead *mh, int x, int y, int w, int h);
+
+#endif /* MULTIHEAD_H */
@@ -0,0 +1,351 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "record.h"
+
+#define TRY(predicate) if(!(predicate)) goto fail
+
+#define HEADER_SIZE 8
+#define ENTRY_SIZE 20
+#define MIN_QUEUE 65536
+// Highest device index accepted from a recording
+#define MAX_DEVICE 65535
+
+struct input_recorder {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; // Signalled when entries are queued or the thread should stop
+	int running;
+	FILE *file;
+	int error; // errno of the first failed write, only used by the thread until it stops
+	uint8_t *queue; // A ring of size bytes with count queued from head
+	size_t size, head, count;
+	// Only used by the thread serving events
+	uint8_t *named; // One flag per device whose name has been queued
+	size_t num_named;
+	InputRecordStats stats;
+};
+
+static void put16(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static uint32_t get16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return get16(p) | (get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t *p) {
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static void putEntry(uint8_t *p, const struct timeval *time, uint32_t device, uint32_t type, uint32_t code, int32_t value) {
+	put64(p, (int64_t)time->tv_sec * 1000000 + time->tv_usec);
+	put32(p + 8, device);
+	put16(p + 12, type);
+	put16(p + 14, code);
+	put32(p + 16, value);
+}
+
+// Copy bytes to the end of the queue, which has room for them
+static void enqueue(InputRecorder *r, const void *bytes, size_t len) {
+	size_t tail = (r->head + r->count) % r->size;
+	size_t first = (len < r->size - tail) ? len : r->size - tail;
+	memcpy(r->queue + tail, bytes, first);
+	memcpy(r->queue, (const uint8_t *)bytes + first, len - first);
+	r->count += len;
+}
+
+static void *writeLoop(InputRecorder *r) {
+	pthread_mutex_lock(&r->lock);
+	for(;;) {
+		while(!r->count && r->running) pthread_cond_wait(&r->wake, &r->lock);
+		if(!r->count) break; // Stopped with everything written
+		// The bytes up to the end of the ring: only the thread serving events adds to the queue, and not here
+		size_t len = (r->count < r->size - r->head) ? r->count : r->size - r->head;
+		pthread_mutex_unlock(&r->lock);
+
+		// Once a write fails the rest of the file is useless
+		size_t written = 0;
+		if(!r->error) {
+			written = fwrite(r->queue + r->head, 1, len, r->file);
+			if(written != len) r->error = errno ? errno : EIO;
+		}
+
+		pthread_mutex_lock(&r->lock);
+		r->head = (r->head + len) % r->size;
+		r->count -= len;
+		r->stats.bytes += written;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+// Mark a device as named, returns non-zero if it can't be
+static int markNamed(InputRecorder *r, size_t dev) {
+	if(dev >= r->num_named) {
+		size_t num = (dev + 1 > r->num_named * 2) ? dev + 1 : r->num_named * 2;
+		uint8_t *grown = realloc(r->named, num);
+		if(!grown) return 1;
+		memset(grown + r->num_named, 0, num - r->num_named);
+		r->named = grown;
+		r->num_named = num;
+	}
+	r->named[dev] = 1;
+	return 0;
+}
+
+void recordEvents(InputDevices *devices, const InputDevice *dev, const InputEvent *evts, size_t num) {
+	InputRecorder *r = devices->recorder;
+	uint32_t device = dev ? (uint32_t)(dev - devices->devices) : INPUT_RECORD_LOOPBACK;
+	int needName = dev && ((device >= r->num_named) || !r->named[device]);
+	size_t nameLen = needName ? strlen(dev->name) : 0;
+	uint8_t entry[ENTRY_SIZE];
+	if(!num) return;
+	if(nameLen > 0xffff) nameLen = 0xffff;
+	size_t len = num * ENTRY_SIZE + (needName ? ENTRY_SIZE + nameLen : 0);
+	pthread_mutex_lock(&r->lock);
+	// Never wait for the file, and never record events of a device without its name
+	if((r->size - r->count < len) || (needName && markNamed(r, device))) {
+		r->stats.dropped += num;
+		pthread_mutex_unlock(&r->lock);
+		return;
+	}
+	if(needName) {
+		putEntry(entry, &evts[0].time, device, INPUT_RECORD_NAME, nameLen, 0);
+		enqueue(r, entry, ENTRY_SIZE);
+		enqueue(r, dev->name, nameLen);
+	}
+	for(size_t i = 0; i < num; i++) {
+		putEntry(entry, &evts[i].time, device, evts[i].type, evts[i].code, evts[i].value);
+		enqueue(r, entry, ENTRY_SIZE);
+	}
+	r->stats.events += num;
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void freeRecorder(InputRecorder *r) {
+	free(r->queue);
+	free(r->named);
+	free(r);
+}
+
+int recordInputEvents(InputDevices *devices, const char *path, size_t queueBytes) {
+	if(devices->recorder) return 1;
+	InputRecorder *r = NULL;
+	uint8_t header[HEADER_SIZE];
+	errno = EBUSY;
+	TRY(devices->serving == SV_IDLE);
+	if(queueBytes < MIN_QUEUE) queueBytes = MIN_QUEUE;
+	TRY(r = calloc(1, sizeof(InputRecorder)));
+	r->running = 1;
+	r->size = queueBytes;
+	TRY(r->queue = malloc(queueBytes));
+	TRY(r->file = fopen(path, "wb"));
+	put32(header, INPUT_RECORD_MAGIC);
+	put16(header + 4, INPUT_RECORD_VERSION);
+	put16(header + 6, 0);
+	TRY(fwrite(header, 1, HEADER_SIZE, r->file) == HEADER_SIZE);
+	r->stats.bytes = HEADER_SIZE;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->wake, NULL);
+	if(pthread_create(&r->thread, NULL, (void *(*)(void *)) writeLoop, r) != 0) {
+		pthread_mutex_destroy(&r->lock);
+		pthread_cond_destroy(&r->wake);
+		goto fail;
+	}
+	devices->recorder = r;
+	return 0;
+fail:
+	perror("recordInputEvents");
+	if(r) {
+		if(r->file) fclose(r->file);
+		freeRecorder(r);
+	}
+	return -1;
+}
+
+int stopRecordingInputEvents(InputDevices *devices) {
+	InputRecorder *r = devices->recorder;
+	if(!r) return 0;
+	pthread_mutex_lock(&r->lock);
+	r->running = 0;
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	devices->recorder = NULL;
+	int error = r->error;
+	if((fclose(r->file) != 0) && !error) error = errno;
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->wake);
+	freeRecorder(r);
+	if(error) {
+		errno = error;
+		perror("stopRecordingInputEvents");
+		return -1;
+	}
+	return 0;
+}
+
+int getInputRecordStats(InputDevices *devices, InputRecordStats *stats) {
+	InputRecorder *r = devices->recorder;
+	if(!r) return 1;
+	pthread_mutex_lock(&r->lock);
+	*stats = r->stats;
+	pthread_mutex_unlock(&r->lock);
+	return 0;
+}
+
+// Read the next event of a recording into f->evt, taking in any names on the way.
+// Returns 1 on success, 0 at its end, -1 on failure. A last entry cut short (by a crash while recording) counts as the end.
+static int readEntry(InputRecordings *r, struct recording_file *f) {
+	uint8_t entry[ENTRY_SIZE];
+	for(;;) {
+		if(fread(entry, 1, ENTRY_SIZE, f->file) != ENTRY_SIZE) return ferror(f->file) ? -1 : 0;
+		int64_t time = get64(entry);
+		uint32_t device = get32(entry + 8);
+		uint32_t type = get16(entry + 12), code = get16(entry + 14);
+		if((device != INPUT_RECORD_LOOPBACK) && (device > MAX_DEVICE)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if(type == INPUT_RECORD_NAME) {
+			char *name = malloc(code + 1);
+			if(!name) return -1;
+			if(fread(name, 1, code, f->file) != code) {
+				free(name);
+				return ferror(f->file) ? -1 : 0;
+			}
+			name[code] = '\0';
+			char **names = realloc(r->names, (r->num_names + 1) * sizeof(char *));
+			if(!names) {
+				free(name);
+				return -1;
+			}
+			r->names = names;
+			if(device >= f->num_names) {
+				size_t *grown = realloc(f->names, (device + 1) * sizeof(size_t));
+				if(!grown) {
+					free(name);
+					return -1;
+				}
+				for(size_t dev = f->num_names; dev <= device; dev++) grown[dev] = SIZE_MAX;
+				f->names = grown;
+				f->num_names = device + 1;
+			}
+			f->names[device] = r->num_names;
+			r->names[r->num_names++] = name;
+			continue;
+		}
+		if((device != INPUT_RECORD_LOOPBACK) && ((device >= f->num_names) || (f->names[device] == SIZE_MAX))) {
+			// Events of a device nobody named
+			errno = EINVAL;
+			return -1;
+		}
+		f->evt.time.tv_sec = time / 1000000;
+		f->evt.time.tv_usec = time % 1000000;
+		if(f->evt.time.tv_usec < 0) {
+			f->evt.time.tv_sec--;
+			f->evt.time.tv_usec += 1000000;
+		}
+		f->evt.type = type;
+		f->evt.code = code;
+		f->evt.value = (int32_t)get32(entry + 16);
+		f->device = device;
+		return 1;
+	}
+}
+
+void closeInputRecordings(InputRecordings *r) {
+	if(!r) return;
+	for(size_t i = 0; r->files && (i < r->num_files); i++) {
+		if(r->files[i].file) fclose(r->files[i].file);
+		free(r->files[i].names);
+	}
+	for(size_t i = 0; i < r->num_names; i++) free(r->names[i]);
+	free(r->names);
+	free(r->files);
+	free(r);
+}
+
+InputRecordings *openInputRecordings(const char **paths, size_t num_paths) {
+	InputRecordings *r = NULL;
+	uint8_t header[HEADER_SIZE];
+	TRY(r = calloc(1, sizeof(InputRecordings)));
+	TRY(r->files = calloc(num_paths ? num_paths : 1, sizeof(struct recording_file)));
+	r->num_files = num_paths;
+	for(size_t i = 0; i < num_paths; i++) {
+		TRY(r->files[i].file = fopen(paths[i], "rb"));
+		errno = EINVAL;
+		TRY(fread(header, 1, HEADER_SIZE, r->files[i].file) == HEADER_SIZE);
+		TRY((get32(header) == INPUT_RECORD_MAGIC) && (get16(header + 4) == INPUT_RECORD_VERSION));
+	}
+	return r;
+fail:
+	perror("openInputRecordings");
+	closeInputRecordings(r);
+	return NULL;
+}
+
+static int isEarlier(const struct timeval *a, const struct timeval *b) {
+	return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_usec < b->tv_usec));
+}
+
+int readInputRecordings(InputRecordings *r) {
+	struct recording_file *next = NULL;
+	for(size_t i = 0; i < r->num_files; i++) {
+		struct recording_file *f = &r->files[i];
+		if(!f->file) continue;
+		if(!f->ready) {
+			int status = readEntry(r, f);
+			if(status == -1) return -1;
+			if(!status) {
+				fclose(f->file);
+				f->file = NULL;
+				continue;
+			}
+			f->ready = 1;
+		}
+		// Ties go to the earlier recording
+		if(!next || isEarlier(&f->evt.time, &next->evt.time)) next = f;
+	}
+	if(!next) return 0;
+	next->ready = 0;
+	r->evt = next->evt;
+	r->device = (next->device == INPUT_RECORD_LOOPBACK) ? -1 : (int)next->names[next->device];
+	return 1;
+}
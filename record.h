@@ -0,0 +1,80 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "input.h"
+
+// Recordings start with a header:
+//	uint32_t magic (INPUT_RECORD_MAGIC), uint16_t version, uint16_t zero
+// followed by one entry per delivered event:
+//	int64_t time (microseconds of the event's timestamp), uint32_t device, uint16_t type, uint16_t code, int32_t value
+// where device is the index in InputDevices.devices, or INPUT_RECORD_LOOPBACK for loopback events.
+// The first event of each device follows an entry with type INPUT_RECORD_NAME and code set to the length of
+// the device's name, which comes next without a terminator. Numbers are little endian.
+#define INPUT_RECORD_MAGIC 0x43524e49
+#define INPUT_RECORD_VERSION 1
+#define INPUT_RECORD_NAME 0xffff
+#define INPUT_RECORD_LOOPBACK 0xffffffff
+
+typedef struct input_record_stats {
+	uint64_t events; // Events queued to be written
+	uint64_t dropped; // Events not recorded because the queue was full
+	uint64_t bytes; // Written to the file so far
+} InputRecordStats;
+
+// Record every event delivered from now on (after filtering) to the file at path. The thread serving events copies them
+// into a queue of queueBytes (at least 64KiB) without waiting: a thread owned by devices writes them, and events that don't fit are dropped.
+// Start and stop recording while not serving events. Returns 0 on success, 1 if already recording, -1 on failure.
+int recordInputEvents(InputDevices *devices, const char *path, size_t queueBytes);
+// Write everything queued and close the file. Returns 0 on success, -1 if anything couldn't be written. Called by close.
+int stopRecordingInputEvents(InputDevices *devices);
+// Returns non-zero if not recording
+int getInputRecordStats(InputDevices *devices, InputRecordStats *stats);
+// Called with the events delivered from dev (NULL for loopback events)
+void recordEvents(InputDevices *devices, const InputDevice *dev, const InputEvent *evts, size_t num);
+
+// Reads several recordings as one, in order of time
+typedef struct input_recordings {
+	InputEvent evt; // The event read last, with its recorded timestamp
+	int device; // Its device, an index in names, or -1 for loopback events
+	char **names; // Every device named so far: devices from different recordings are always different
+	size_t num_names;
+	// The rest is private
+	size_t num_files;
+	struct recording_file {
+		FILE *file;
+		int ready; // evt and device hold its next event
+		InputEvent evt;
+		uint32_t device;
+		size_t *names; // Index in names of each device named in the file, SIZE_MAX if not named yet
+		size_t num_names;
+	} *files;
+} InputRecordings;
+
+// Returns NULL on failure
+InputRecordings *openInputRecordings(const char **paths, size_t num_paths);
+void closeInputRecordings(InputRecordings *r);
+// Read the next event of all the recordings: the earliest of the next events of each one, which keep their own order.
+// Returns 1 on success, 0 at the end of every recording, -1 on failure.
+int readInputRecordings(InputRecordings *r);
+
+#endif /* RECORD_H */
@@ -0,0 +1,154 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "rotate.h"
+
+// Kernels, chosen once for the CPU
+static void (*rotateBlockKernel)(Pixel *dst, const Pixel *src, size_t stride, int w, int h, int turns);
+static void (*reversePixelsKernel)(Pixel *dst, const Pixel *src, size_t n);
+static pthread_once_t kernelsChosen = PTHREAD_ONCE_INIT;
+
+// Clockwise, line r of dst is column r of src read upwards. Anticlockwise, it is column w - 1 - r read downwards.
+static void rotateBlockScalar(Pixel *dst, const Pixel *src, size_t stride, int w, int h, int turns) {
+	for(int r = 0; r < w; r++, dst += h) {
+		if(turns == 1) {
+			for(int j = 0; j < h; j++) dst[j] = src[(h - 1 - j) * stride + r];
+		} else {
+			for(int j = 0; j < h; j++) dst[j] = src[j * stride + (w - 1 - r)];
+		}
+	}
+}
+
+static void reversePixelsScalar(Pixel *dst, const Pixel *src, size_t n) {
+	for(size_t i = 0; i < n; i++) dst[i] = src[n - 1 - i];
+}
+
+// Whole blocks are turned in 4 by 4 squares of pixels, edges with the scalar kernel.
+// Clockwise the square's source lines are loaded bottom up, anticlockwise its columns are stored in reverse.
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static void rotateBlockSSE2(Pixel *dst, const Pixel *src, size_t stride, int w, int h, int turns) {
+	if((w % 4) || (h % 4)) {
+		rotateBlockScalar(dst, src, stride, w, h, turns);
+		return;
+	}
+	ptrdiff_t step = (turns == 1) ? -(ptrdiff_t)stride : (ptrdiff_t)stride;
+	for(int r = 0; r < w; r += 4) {
+		const Pixel *s = (turns == 1) ? src + (h - 1) * stride + r : src + (w - 4 - r);
+		Pixel *d = dst + r * h;
+		for(int j = 0; j < h; j += 4, s += 4 * step) {
+			__m128 l0 = _mm_loadu_ps((const float *)s);
+			__m128 l1 = _mm_loadu_ps((const float *)(s + step));
+			__m128 l2 = _mm_loadu_ps((const float *)(s + 2 * step));
+			__m128 l3 = _mm_loadu_ps((const float *)(s + 3 * step));
+			_MM_TRANSPOSE4_PS(l0, l1, l2, l3);
+			if(turns == 1) {
+				_mm_storeu_ps((float *)(d + j), l0);
+				_mm_storeu_ps((float *)(d + h + j), l1);
+				_mm_storeu_ps((float *)(d + 2 * h + j), l2);
+				_mm_storeu_ps((float *)(d + 3 * h + j), l3);
+			} else {
+				_mm_storeu_ps((float *)(d + j), l3);
+				_mm_storeu_ps((float *)(d + h + j), l2);
+				_mm_storeu_ps((float *)(d + 2 * h + j), l1);
+				_mm_storeu_ps((float *)(d + 3 * h + j), l0);
+			}
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static void reversePixelsSSE2(Pixel *dst, const Pixel *src, size_t n) {
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + n - 4 - i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi32(v, 0x1b));
+	}
+	reversePixelsScalar(dst + i, src, n - i);
+}
+#endif /* HAVE_X86 */
+
+#ifdef __ARM_NEON
+static void rotateBlockNEON(Pixel *dst, const Pixel *src, size_t stride, int w, int h, int turns) {
+	if((w % 4) || (h % 4)) {
+		rotateBlockScalar(dst, src, stride, w, h, turns);
+		return;
+	}
+	ptrdiff_t step = (turns == 1) ? -(ptrdiff_t)stride : (ptrdiff_t)stride;
+	for(int r = 0; r < w; r += 4) {
+		const Pixel *s = (turns == 1) ? src + (h - 1) * stride + r : src + (w - 4 - r);
+		Pixel *d = dst + r * h;
+		for(int j = 0; j < h; j += 4, s += 4 * step) {
+			uint32x4x2_t t0 = vtrnq_u32(vld1q_u32((const uint32_t *)s), vld1q_u32((const uint32_t *)(s + step)));
+			uint32x4x2_t t1 = vtrnq_u32(vld1q_u32((const uint32_t *)(s + 2 * step)), vld1q_u32((const uint32_t *)(s + 3 * step)));
+			uint32x4_t column[4] = {
+				vcombine_u32(vget_low_u32(t0.val[0]), vget_low_u32(t1.val[0])),
+				vcombine_u32(vget_low_u32(t0.val[1]), vget_low_u32(t1.val[1])),
+				vcombine_u32(vget_high_u32(t0.val[0]), vget_high_u32(t1.val[0])),
+				vcombine_u32(vget_high_u32(t0.val[1]), vget_high_u32(t1.val[1])),
+			};
+			for(int k = 0; k < 4; k++) vst1q_u32((uint32_t *)(d + k * h + j), column[(turns == 1) ? k : 3 - k]);
+		}
+	}
+}
+
+static void reversePixelsNEON(Pixel *dst, const Pixel *src, size_t n) {
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		uint32x4_t v = vrev64q_u32(vld1q_u32((const uint32_t *)(src + n - 4 - i)));
+		vst1q_u32((uint32_t *)(dst + i), vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+	}
+	reversePixelsScalar(dst + i, src, n - i);
+}
+#endif /* __ARM_NEON */
+
+static void chooseKernels(void) {
+	rotateBlockKernel = rotateBlockScalar;
+	reversePixelsKernel = reversePixelsScalar;
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		rotateBlockKernel = rotateBlockSSE2;
+		reversePixelsKernel = reversePixelsSSE2;
+	}
+#endif
+#ifdef __ARM_NEON
+	rotateBlockKernel = rotateBlockNEON;
+	reversePixelsKernel = reversePixelsNEON;
+#endif
+}
+
+void rotateBlock(Pixel *dst, const Pixel *src, size_t stride, int w, int h, int turns) {
+	pthread_once(&kernelsChosen, chooseKernels);
+	rotateBlockKernel(dst, src, stride, w, h, turns);
+}
+
+void reversePixels(Pixel *dst, const Pixel *src, size_t n) {
+	pthread_once(&kernelsChosen, chooseKernels);
+	reversePixelsKernel(dst, src, n);
+}
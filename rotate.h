@@ -0,0 +1,33 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ROTATE_H
+#define ROTATE_H 1
+
+// Rotation of pixel blocks, used internally by fb.c
+
+#include <stddef.h>
+
+#include "fb.h"
+
+// Turn the w by h block at src (stride pixels between its lines) a quarter turn clockwise if turns is 1, anticlockwise if 3.
+// The result is w lines of h pixels at dst, top line first.
+void rotateBlock(Pixel *dst, const Pixel *src, size_t stride, int w, int h, int turns);
+// dst[i] = src[n - 1 - i]
+void reversePixels(Pixel *dst, const Pixel *src, size_t n);
+
+#endif /* ROTATE_H */
@@ -0,0 +1,208 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "scale.h"
+
+// Kernels, chosen once for the CPU
+static void (*lerpRowsKernel)(Pixel *dst, const Pixel *a, const Pixel *b, size_t n, unsigned w);
+static void (*lerpPixelsKernel)(Pixel *dst, const Pixel *src, size_t n, uint32_t x, uint32_t dx);
+static pthread_once_t kernelsChosen = PTHREAD_ONCE_INIT;
+
+static inline uint8_t lerp(uint32_t a, uint32_t b, uint32_t w) {
+	return (a * (256 - w) + b * w + 128) >> 8;
+}
+
+static inline Pixel lerpPixel(Pixel a, Pixel b, uint32_t w) {
+	return (Pixel) {
+		.r = lerp(a.r, b.r, w),
+		.g = lerp(a.g, b.g, w),
+		.b = lerp(a.b, b.b, w),
+		.a = lerp(a.a, b.a, w),
+	};
+}
+
+static void lerpRowsScalar(Pixel *dst, const Pixel *a, const Pixel *b, size_t n, unsigned w) {
+	for(size_t i = 0; i < n; i++) dst[i] = lerpPixel(a[i], b[i], w);
+}
+
+static void lerpPixelsScalar(Pixel *dst, const Pixel *src, size_t n, uint32_t x, uint32_t dx) {
+	for(size_t i = 0; i < n; i++, x += dx) dst[i] = lerpPixel(src[x >> 16], src[(x >> 16) + 1], (x >> 8) & 255);
+}
+
+#ifdef HAVE_X86
+// Channels are widened to 16 bits: 255 * 256 + 128 still fits
+__attribute__((target("sse2")))
+static inline __m128i lerp16SSE2(__m128i a, __m128i b, __m128i wa, __m128i wb) {
+	__m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(a, wa), _mm_mullo_epi16(b, wb)), _mm_set1_epi16(128));
+	return _mm_srli_epi16(t, 8);
+}
+
+__attribute__((target("sse2")))
+static void lerpRowsSSE2(Pixel *dst, const Pixel *a, const Pixel *b, size_t n, unsigned w) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wa = _mm_set1_epi16(256 - w), wb = _mm_set1_epi16(w);
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i lo = lerp16SSE2(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero), wa, wb);
+		__m128i hi = lerp16SSE2(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero), wa, wb);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+	lerpRowsScalar(dst + i, a + i, b + i, n - i, w);
+}
+
+// Blend whole pixels a and b by the fraction of x in each 32 bit lane.
+// Red and blue, then green and alpha, are multiplied as pairs of 16 bit lanes with the weight in both halves.
+__attribute__((target("sse2")))
+static inline __m128i lerpPairsSSE2(__m128i a, __m128i b, __m128i x) {
+	const __m128i low = _mm_set1_epi32(0x00ff00ff), half = _mm_set1_epi16(128);
+	__m128i w = _mm_and_si128(_mm_srli_epi32(x, 8), _mm_set1_epi32(255));
+	w = _mm_or_si128(w, _mm_slli_epi32(w, 16));
+	__m128i iw = _mm_sub_epi16(_mm_set1_epi16(256), w);
+	__m128i rb = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(a, low), iw), _mm_mullo_epi16(_mm_and_si128(b, low), w)), half);
+	__m128i ag = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_srli_epi16(a, 8), iw), _mm_mullo_epi16(_mm_srli_epi16(b, 8), w)), half);
+	return _mm_or_si128(_mm_srli_epi16(rb, 8), _mm_andnot_si128(low, ag));
+}
+
+__attribute__((target("sse2")))
+static void lerpPixelsSSE2(Pixel *dst, const Pixel *src, size_t n, uint32_t x, uint32_t dx) {
+	const uint32_t *s = (const uint32_t *)src;
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4, x += 4 * dx) {
+		uint32_t x0 = x >> 16, x1 = (x + dx) >> 16, x2 = (x + 2 * dx) >> 16, x3 = (x + 3 * dx) >> 16;
+		__m128i a = _mm_set_epi32(s[x3], s[x2], s[x1], s[x0]);
+		__m128i b = _mm_set_epi32(s[x3 + 1], s[x2 + 1], s[x1 + 1], s[x0 + 1]);
+		__m128i xv = _mm_add_epi32(_mm_set1_epi32(x), _mm_set_epi32(3 * dx, 2 * dx, dx, 0));
+		_mm_storeu_si128((__m128i *)(dst + i), lerpPairsSSE2(a, b, xv));
+	}
+	lerpPixelsScalar(dst + i, src, n - i, x, dx);
+}
+
+__attribute__((target("avx2")))
+static void lerpRowsAVX2(Pixel *dst, const Pixel *a, const Pixel *b, size_t n, unsigned w) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i wa = _mm256_set1_epi16(256 - w), wb = _mm256_set1_epi16(w), half = _mm256_set1_epi16(128);
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		// Unpacking and packing both work within 128 bit lanes, so pixel order is preserved
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), wa), _mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), wb));
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), wa), _mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), wb));
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, half), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, half), 8);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+	}
+	lerpRowsScalar(dst + i, a + i, b + i, n - i, w);
+}
+
+__attribute__((target("avx2")))
+static void lerpPixelsAVX2(Pixel *dst, const Pixel *src, size_t n, uint32_t x, uint32_t dx) {
+	const __m256i low = _mm256_set1_epi32(0x00ff00ff), half = _mm256_set1_epi16(128), one = _mm256_set1_epi32(1);
+	const __m256i step = _mm256_set1_epi32(8 * dx);
+	__m256i xv = _mm256_add_epi32(_mm256_set1_epi32(x), _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(dx)));
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8, x += 8 * dx, xv = _mm256_add_epi32(xv, step)) {
+		__m256i index = _mm256_srli_epi32(xv, 16);
+		__m256i a = _mm256_i32gather_epi32((const int *)src, index, 4);
+		__m256i b = _mm256_i32gather_epi32((const int *)src, _mm256_add_epi32(index, one), 4);
+		// As in lerpPairsSSE2
+		__m256i w = _mm256_and_si256(_mm256_srli_epi32(xv, 8), _mm256_set1_epi32(255));
+		w = _mm256_or_si256(w, _mm256_slli_epi32(w, 16));
+		__m256i iw = _mm256_sub_epi16(_mm256_set1_epi16(256), w);
+		__m256i rb = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(a, low), iw), _mm256_mullo_epi16(_mm256_and_si256(b, low), w)), half);
+		__m256i ag = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_srli_epi16(a, 8), iw), _mm256_mullo_epi16(_mm256_srli_epi16(b, 8), w)), half);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(_mm256_srli_epi16(rb, 8), _mm256_andnot_si256(low, ag)));
+	}
+	lerpPixelsScalar(dst + i, src, n - i, x, dx);
+}
+#endif /* HAVE_X86 */
+
+#ifdef __ARM_NEON
+// Weights of 0 and 256 don't fit in 8 bits, but they are plain copies
+static void lerpRowsNEON(Pixel *dst, const Pixel *a, const Pixel *b, size_t n, unsigned w) {
+	if(!w || (w == 256)) {
+		memcpy(dst, w ? b : a, n * sizeof(Pixel));
+		return;
+	}
+	const uint8x8_t wa = vdup_n_u8(256 - w), wb = vdup_n_u8(w);
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		uint8x16_t va = vld1q_u8((const uint8_t *)(a + i));
+		uint8x16_t vb = vld1q_u8((const uint8_t *)(b + i));
+		uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), wa), vget_low_u8(vb), wb);
+		uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), wa), vget_high_u8(vb), wb);
+		vst1q_u8((uint8_t *)(dst + i), vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+	}
+	lerpRowsScalar(dst + i, a + i, b + i, n - i, w);
+}
+#endif /* __ARM_NEON */
+
+static void chooseKernels(void) {
+	lerpRowsKernel = lerpRowsScalar;
+	lerpPixelsKernel = lerpPixelsScalar;
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		lerpRowsKernel = lerpRowsSSE2;
+		lerpPixelsKernel = lerpPixelsSSE2;
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		lerpRowsKernel = lerpRowsAVX2;
+		lerpPixelsKernel = lerpPixelsAVX2;
+	}
+#endif
+#ifdef __ARM_NEON
+	lerpRowsKernel = lerpRowsNEON;
+#endif
+}
+
+void lerpRows(Pixel *dst, const Pixel *a, const Pixel *b, size_t n, unsigned w) {
+	pthread_once(&kernelsChosen, chooseKernels);
+	lerpRowsKernel(dst, a, b, n, w);
+}
+
+void lerpPixels(Pixel *dst, const Pixel *src, size_t n, uint32_t x, uint32_t dx) {
+	pthread_once(&kernelsChosen, chooseKernels);
+	lerpPixelsKernel(dst, src, n, x, dx);
+}
+
+void repeatPixels(Pixel *dst, const Pixel *src, size_t n, int phase, int k) {
+	size_t i = 0;
+	src += phase / k;
+	phase %= k;
+	// Finish the partly covered source pixel, then repeat each one k times
+	for(; (i < n) && phase && (phase < k); i++, phase++) dst[i] = *src;
+	if(phase) src++;
+	for(; i + k <= n; i += k, src++) {
+		for(int j = 0; j < k; j++) dst[i + j] = *src;
+	}
+	for(; i < n; i++) dst[i] = *src;
+}
@@ -0,0 +1,36 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCALE_H
+#define SCALE_H 1
+
+// Scanline upscaling, used internally by fb.c
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fb.h"
+
+// dst[i] = (a[i] * (256 - w) + b[i] * w) / 256 for n pixels, rounded, with w from 0 to 256
+void lerpRows(Pixel *dst, const Pixel *a, const Pixel *b, size_t n, unsigned w);
+// Resample src into n pixels: pixel i blends src[x >> 16] and the one after by the fraction of x, then x steps by dx.
+// x and dx are 16.16 fixed point, and src must have a pixel after the last one sampled.
+void lerpPixels(Pixel *dst, const Pixel *src, size_t n, uint32_t x, uint32_t dx);
+// dst[i] = src[(i + phase) / k] for n pixels
+void repeatPixels(Pixel *dst, const Pixel *src, size_t n, int phase, int k);
+
+#endif /* SCALE_H */
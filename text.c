@@ -0,0 +1,316 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "text.h"
+
+#define TRY(predicate) if(!(predicate)) goto fail
+
+// PC Screen Font headers, see the kbd package's psf.h
+#define PSF1_MAGIC 0x0436
+#define PSF1_MODE512 0x01
+#define PSF1_MODEHASTAB 0x02
+#define PSF1_MODEHASSEQ 0x04
+#define PSF1_SEPARATOR 0xffff
+#define PSF1_STARTSEQ 0xfffe
+#define PSF2_MAGIC 0x864ab572
+#define PSF2_HAS_UNICODE_TABLE 0x01
+#define PSF2_SEPARATOR 0xff
+#define PSF2_STARTSEQ 0xfe
+
+static uint32_t le16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Decode the UTF-8 character at *text and move past it. Malformed bytes decode to U+FFFD one at a time.
+// A sequence can't run past end, or past a NUL if end is NULL.
+static uint32_t nextChar(const char **text, const char *end) {
+	static const uint8_t masks[4] = {0x7f, 0x1f, 0x0f, 0x07};
+	const uint8_t *s = (const uint8_t *)*text;
+	uint32_t c = *s++;
+	int extra = (c >= 0xf0) ? 3 : (c >= 0xe0) ? 2 : (c >= 0xc0) ? 1 : 0;
+	*text = (const char *)s;
+	if(((c >= 0x80) && (c < 0xc0)) || (c >= 0xf8)) return 0xfffd;
+	c &= masks[extra];
+	for(int i = 0; i < extra; i++, s++) {
+		if((end && ((const char *)s == end)) || ((*s & 0xc0) != 0x80)) return 0xfffd;
+		c = (c << 6) | (*s & 0x3f);
+	}
+	*text = (const char *)s;
+	return c;
+}
+
+typedef struct mapping {
+	uint32_t codepoint;
+	int glyph;
+} Mapping;
+
+static int compareMappings(const void *a, const void *b) {
+	const Mapping *x = a, *y = b;
+	if(x->codepoint != y->codepoint) return (x->codepoint > y->codepoint) - (x->codepoint < y->codepoint);
+	return x->glyph - y->glyph; // Keep the first glyph listed for a codepoint
+}
+
+static int addMapping(Mapping **map, int *num, int *max, uint32_t codepoint, int glyph) {
+	if(*num == *max) {
+		Mapping *grown = realloc(*map, (*max ? *max * 2 : 256) * sizeof(Mapping));
+		if(!grown) return 1;
+		*map = grown;
+		*max = *max ? *max * 2 : 256;
+	}
+	(*map)[(*num)++] = (Mapping) {codepoint, glyph};
+	return 0;
+}
+
+// Read the unicode table that follows the glyphs, one entry per glyph.
+// Only single codepoints are used: sequences (combining characters) are skipped.
+static int readTable(const uint8_t *p, const uint8_t *end, int numGlyphs, int psf2, Mapping **map, int *num) {
+	int max = 0;
+	for(int g = 0; (g < numGlyphs) && (p < end); g++) {
+		int inSequence = 0;
+		while(p < end) {
+			uint32_t c;
+			if(psf2) {
+				if(*p == PSF2_SEPARATOR) { p++; break; }
+				if(*p == PSF2_STARTSEQ) { p++; inSequence = 1; continue; }
+				const char *s = (const char *)p;
+				c = nextChar(&s, (const char *)end);
+				p = (const uint8_t *)s;
+			} else {
+				if(p + 2 > end) return 0;
+				c = le16(p);
+				p += 2;
+				if(c == PSF1_SEPARATOR) break;
+				if(c == PSF1_STARTSEQ) { inSequence = 1; continue; }
+			}
+			if(!inSequence && addMapping(map, num, &max, c, g)) return 1;
+		}
+	}
+	return 0;
+}
+
+static int compareCodepoints(const void *key, const void *member) {
+	uint32_t a = *(const uint32_t *)key, b = *(const uint32_t *)member;
+	return (a > b) - (a < b);
+}
+
+static int findGlyph(const Font *font, uint32_t c) {
+	if(c < 256) return font->latin1[c];
+	const uint32_t *found = bsearch(&c, font->codepoints, font->numCodepoints, sizeof(uint32_t), compareCodepoints);
+	return found ? font->glyphs[found - font->codepoints] : -1;
+}
+
+static Font *readFont(const uint8_t *data, size_t size) {
+	Font *font = NULL;
+	Mapping *map = NULL;
+	int num = 0;
+	size_t offset;
+	int hasTable, max = 0;
+	TRY(font = calloc(1, sizeof(Font)));
+	errno = EINVAL;
+	if((size >= 4) && (le16(data) == PSF1_MAGIC)) {
+		uint8_t mode = data[2];
+		font->width = 8;
+		font->height = data[3];
+		font->numGlyphs = (mode & PSF1_MODE512) ? 512 : 256;
+		font->glyphBytes = font->height;
+		hasTable = mode & (PSF1_MODEHASTAB | PSF1_MODEHASSEQ);
+		offset = 4;
+	} else {
+		TRY((size >= 32) && (le32(data) == PSF2_MAGIC));
+		offset = le32(data + 8);
+		hasTable = le32(data + 12) & PSF2_HAS_UNICODE_TABLE;
+		font->numGlyphs = le32(data + 16);
+		font->glyphBytes = le32(data + 20);
+		font->height = le32(data + 24);
+		font->width = le32(data + 28);
+		TRY((font->width > 0) && (font->width <= 256) && (font->numGlyphs > 0) && (font->numGlyphs <= 65536));
+	}
+	font->rowBytes = (font->width + 7) / 8;
+	TRY((font->height > 0) && (font->height <= 256) && (font->glyphBytes >= font->rowBytes * font->height));
+	TRY((offset <= size) && ((size - offset) / font->glyphBytes >= (size_t)font->numGlyphs));
+	TRY(font->bitmaps = malloc((size_t)font->numGlyphs * font->glyphBytes));
+	memcpy(font->bitmaps, data + offset, (size_t)font->numGlyphs * font->glyphBytes);
+	offset += (size_t)font->numGlyphs * font->glyphBytes;
+	if(hasTable) {
+		TRY(!readTable(data + offset, data + size, font->numGlyphs, le16(data) != PSF1_MAGIC, &map, &num));
+	} else {
+		// Glyphs are in codepoint order
+		for(int g = 0; g < font->numGlyphs; g++) TRY(!addMapping(&map, &num, &max, g, g));
+	}
+	qsort(map, num, sizeof(Mapping), compareMappings);
+	TRY(font->codepoints = malloc((num ? num : 1) * sizeof(uint32_t)));
+	TRY(font->glyphs = malloc((num ? num : 1) * sizeof(int)));
+	memset(font->latin1, -1, sizeof(font->latin1));
+	for(int i = 0; i < num; i++) {
+		if(font->numCodepoints && (font->codepoints[font->numCodepoints - 1] == map[i].codepoint)) continue;
+		font->codepoints[font->numCodepoints] = map[i].codepoint;
+		font->glyphs[font->numCodepoints++] = map[i].glyph;
+		if(map[i].codepoint < 256) font->latin1[map[i].codepoint] = map[i].glyph;
+	}
+	free(map);
+	// Characters the font doesn't have are shown as U+FFFD, or '?' if it has no U+FFFD either
+	if((font->fallback = findGlyph(font, 0xfffd)) < 0) font->fallback = findGlyph(font, '?');
+	if(font->fallback < 0) font->fallback = 0;
+	return font;
+fail:
+	free(map);
+	if(font) freeFont(font);
+	return NULL;
+}
+
+Font *parseFont(const uint8_t *data, size_t size) {
+	Font *font = readFont(data, size);
+	if(!font) perror("parseFont");
+	return font;
+}
+
+Font *loadFont(const char *path) {
+	FILE *f = NULL;
+	uint8_t *data = NULL;
+	Font *font = NULL;
+	long size;
+	TRY(f = fopen(path, "rb"));
+	TRY(!fseek(f, 0, SEEK_END));
+	TRY((size = ftell(f)) >= 0);
+	TRY(!fseek(f, 0, SEEK_SET));
+	TRY(data = malloc(size ? size : 1));
+	TRY(fread(data, 1, size, f) == (size_t)size);
+	if((size >= 2) && (data[0] == 0x1f) && (data[1] == 0x8b)) {
+		fprintf(stderr, "loadFont: %s is gzipped, decompress it first\n", path);
+		goto done;
+	}
+	if(!(font = readFont(data, size))) goto fail;
+	goto done;
+fail:
+	perror("loadFont");
+done:
+	free(data);
+	if(f) fclose(f);
+	return font;
+}
+
+void freeFont(Font *font) {
+	free(font->bitmaps);
+	free(font->codepoints);
+	free(font->glyphs);
+	free(font);
+}
+
+static int glyphFor(const Font *font, uint32_t c) {
+	int g = findGlyph(font, c);
+	return (g >= 0) ? g : font->fallback;
+}
+
+GlyphAtlas *newGlyphAtlas(const Font *font, Pixel colour, Pixel background) {
+	GlyphAtlas *atlas = NULL;
+	TRY(atlas = calloc(1, sizeof(GlyphAtlas)));
+	atlas->font = font;
+	atlas->colour = colour;
+	atlas->background = background;
+	atlas->opaque = (colour.a == 255) && (background.a == 255);
+	TRY(atlas->pixels = malloc((size_t)font->numGlyphs * font->height * font->width * sizeof(Pixel)));
+	TRY(atlas->ready = calloc(font->numGlyphs, 1));
+	return atlas;
+fail:
+	perror("newGlyphAtlas");
+	if(atlas) freeGlyphAtlas(atlas);
+	return NULL;
+}
+
+void freeGlyphAtlas(GlyphAtlas *atlas) {
+	free(atlas->pixels);
+	free(atlas->ready);
+	free(atlas);
+}
+
+static void rasterize(GlyphAtlas *atlas, int g) {
+	const Font *font = atlas->font;
+	const uint8_t *bits = font->bitmaps + (size_t)g * font->glyphBytes;
+	Pixel *p = atlas->pixels + (size_t)g * font->height * font->width;
+	for(int y = 0; y < font->height; y++, bits += font->rowBytes) {
+		for(int x = 0; x < font->width; x++) {
+			*p++ = (bits[x >> 3] & (0x80 >> (x & 7))) ? atlas->colour : atlas->background;
+		}
+	}
+	atlas->ready[g] = 1;
+}
+
+static void markLine(Surface *dst, int x0, int x1, int y, int h) {
+	if(!dst->damage) return;
+	if(x0 < 0) x0 = 0;
+	if(x1 > dst->width) x1 = dst->width;
+	if(y < 0) {
+		h += y;
+		y = 0;
+	}
+	if(y + h > dst->height) h = dst->height - y;
+	if((x1 > x0) && (h > 0)) dst->damage(dst->damageTarget, x0, y, x1 - x0, h);
+}
+
+int drawText(Surface *dst, GlyphAtlas *atlas, int x, int y, const char *text) {
+	const Font *font = atlas->font;
+	// Damage is marked per line below rather than per glyph
+	Surface quiet = *dst;
+	quiet.damage = NULL;
+	Surface glyphs = imageSurface(atlas->pixels, font->width, font->numGlyphs * font->height);
+	int left = x;
+	while(*text) {
+		uint32_t c = nextChar(&text, NULL);
+		if(c == '\n') {
+			markLine(dst, left, x, y, font->height);
+			x = left;
+			y += font->height;
+			continue;
+		}
+		// Glyphs that are clipped away entirely aren't rasterized
+		if((x < dst->width) && (x + font->width > 0) && (y < dst->height) && (y + font->height > 0)) {
+			int g = glyphFor(font, c);
+			if(!atlas->ready[g]) rasterize(atlas, g);
+			if(atlas->opaque) {
+				blitRect(&quiet, x, y, &glyphs, 0, g * font->height, font->width, font->height);
+			} else {
+				blendBlitRect(&quiet, x, y, &glyphs, 0, g * font->height, font->width, font->height);
+			}
+		}
+		x += font->width;
+	}
+	markLine(dst, left, x, y, font->height);
+	return x;
+}
+
+void measureText(const Font *font, const char *text, int *w, int *h) {
+	int columns = 0, lines = *text ? 1 : 0, longest = 0;
+	while(*text) {
+		if(nextChar(&text, NULL) == '\n') {
+			columns = 0;
+			lines++;
+		} else if(++columns > longest) {
+			longest = columns;
+		}
+	}
+	*w = longest * font->width;
+	*h = lines * font->height;
+}
@@ -0,0 +1,67 @@
+/**
+ *	Copyright (C) 2016 Stuart Bassett
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEXT_H
+#define TEXT_H 1
+
+#include <stdint.h>
+
+#include "fb.h"
+#include "draw.h"
+
+// A bitmap font with glyphs of width * height pixels
+typedef struct font {
+	int width, height;
+	int numGlyphs;
+	// The rest is private
+	int rowBytes; // Bytes per row of a glyph's bitmap
+	int glyphBytes;
+	uint8_t *bitmaps;
+	int32_t latin1[256]; // Glyph for each of the first 256 codepoints, -1 if none
+	uint32_t *codepoints; // Sorted, with the glyph for codepoints[i] in glyphs[i]
+	int *glyphs;
+	int numCodepoints;
+	int fallback; // Glyph shown for characters the font doesn't have
+} Font;
+
+// Glyphs of a font rasterized in one colour on one background, ready to be copied into frames
+typedef struct glyphAtlas {
+	const Font *font;
+	Pixel colour, background; // A background with alpha 0 leaves what is behind the text
+	// The rest is private
+	Pixel *pixels; // Glyph g occupies rows g * height to (g + 1) * height of an image font->width pixels wide
+	uint8_t *ready; // One flag per glyph: set once it has been rasterized
+	int opaque; // Every pixel has alpha 255, so glyphs are copied rather than blended
+} GlyphAtlas;
+
+// Load a PC Screen Font (version 1 or 2, as used by the Linux console, but not gzipped), returns NULL on failure
+Font *loadFont(const char *path);
+// The same from a copy of the file in memory
+Font *parseFont(const uint8_t *data, size_t size);
+void freeFont(Font *font);
+
+// Returns NULL on failure. Glyphs are rasterized the first time they are drawn.
+GlyphAtlas *newGlyphAtlas(const Font *font, Pixel colour, Pixel background);
+void freeGlyphAtlas(GlyphAtlas *atlas);
+
+// Draw UTF-8 text with its top left corner at (x, y), clipped to dst. A newline starts another line below at x.
+// Damage is marked once for each line. Returns the x coordinate after the last character drawn.
+int drawText(Surface *dst, GlyphAtlas *atlas, int x, int y, const char *text);
+// Width and height in pixels of the rectangle that drawText would cover
+void measureText(const Font *font, const char *text, int *w, int *h);
+
+#endif /* TEXT_H */